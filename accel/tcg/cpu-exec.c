@@ -256,8 +256,7 @@ void cpu_exec_step_atomic_pf(CPUState *cpu)
         in_exclusive_region = true;
         cc->cpu_exec_enter(cpu);
         /* execute the generated code */
-        trace_exec_tb(tb, pc);
-		fprintf(stderr, "pf_llsc exec pc %x\n", pc);
+        trace_exec_tb_atomic_pf(tb, pc);
         cpu_tb_exec(cpu, tb);
         cc->cpu_exec_exit(cpu);
     } else {
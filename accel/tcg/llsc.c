@@ -0,0 +1,374 @@
+/*
+ * ABA-safe LL/SC for linux-user guests
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Target-independent half of the PST scheme.  A target hooks its
+ * load-linked into tcg_gen_llsc_reserve() and its store-conditional into
+ * tcg_gen_llsc_store_cond_*(), which call the helpers below; everything
+ * else (the monitor, page protection, the fault handler) is shared.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/host-utils.h"
+#include "cpu.h"
+#include "exec/helper-proto.h"
+#include "exec/exec-all.h"
+#include "tcg-op.h"
+#include "trace.h"
+
+#include "qemu.h"
+#include "x-monitor.h"
+#include "llsc-profile.h"
+
+bool tcg_llsc_enabled(void)
+{
+    return llsc_uses_pst();
+}
+
+bool tcg_llsc_stats_enabled(void)
+{
+    return llsc_stats_path != NULL;
+}
+
+void HELPER(llsc_stat)(uint32_t stat)
+{
+    if (stat >= LLSC_STAT_SC_OK && stat <= LLSC_STAT_SC_FAIL_LOST) {
+        llsc_stat_inc(LLSC_STAT_SC);
+    }
+    llsc_stat_inc(stat);
+}
+
+/* Outcome of an unmonitored store-conditional with guest status STATUS.  */
+void HELPER(llsc_stat_sc)(uint64_t status)
+{
+    llsc_stat_sc(status ? LLSC_STAT_SC_FAIL_VALUE : LLSC_STAT_SC_OK);
+}
+
+bool tcg_llsc_profile_enabled(void)
+{
+    return llsc_profile_enabled();
+}
+
+void HELPER(llsc_profile_ll)(target_ulong pc)
+{
+    llsc_profile_add(pc, LLSC_PROF_LL, 1);
+}
+
+void HELPER(llsc_profile_sc)(target_ulong pc, uint64_t status)
+{
+    llsc_profile_sc(pc, status);
+}
+
+/*
+ * Reserve ADDR for the calling thread.  Its page is write-protected, so
+ * that any other store to it faults and breaks the reservation.
+ */
+void HELPER(llsc_reserve)(CPUArchState *env, target_ulong addr)
+{
+    TaskState *ts = env_cpu(env)->opaque;
+    target_ulong page_addr = addr & TARGET_PAGE_MASK;
+
+    llsc_stat_inc(LLSC_STAT_LL);
+    x_monitor_sc_lock();
+    x_monitor_set_exclusive_addr(ts->x_monitor_node, addr);
+    /*
+     * No-op if the page is still protected from an earlier reservation;
+     * otherwise it is also aliased to the shadow.
+     */
+    x_monitor_pst_protect(page_addr);
+    x_monitor_sc_unlock();
+}
+
+/* Drop the reservation of the calling thread, if any.  */
+void HELPER(llsc_clrex)(CPUArchState *env)
+{
+    TaskState *ts = env_cpu(env)->opaque;
+
+    x_monitor_clear_exclusive(ts->x_monitor_node);
+}
+
+/*
+ * Compare-and-swap of a MEMOP-sized value at host address P, with MO_BSWAP
+ * relative to the host.  Returns true if NEWV was stored.
+ */
+static bool x_monitor_cmpxchg(void *p, uint64_t cmpv, uint64_t newv,
+                              TCGMemOp memop)
+{
+    switch (memop & (MO_SIZE | MO_BSWAP)) {
+    case MO_8:
+    case MO_8 | MO_BSWAP:
+        return atomic_cmpxchg((uint8_t *)p, (uint8_t)cmpv, (uint8_t)newv)
+               == (uint8_t)cmpv;
+    case MO_16:
+        return atomic_cmpxchg((uint16_t *)p, (uint16_t)cmpv, (uint16_t)newv)
+               == (uint16_t)cmpv;
+    case MO_16 | MO_BSWAP:
+        return x_monitor_cmpxchg(p, bswap16(cmpv), bswap16(newv), MO_16);
+    case MO_32:
+        return atomic_cmpxchg((uint32_t *)p, (uint32_t)cmpv, (uint32_t)newv)
+               == (uint32_t)cmpv;
+    case MO_32 | MO_BSWAP:
+        return x_monitor_cmpxchg(p, bswap32(cmpv), bswap32(newv), MO_32);
+    case MO_64:
+        return atomic_cmpxchg__nocheck((uint64_t *)p, cmpv, newv) == cmpv;
+    case MO_64 | MO_BSWAP:
+        return x_monitor_cmpxchg(p, bswap64(cmpv), bswap64(newv), MO_64);
+    default:
+        g_assert_not_reached();
+    }
+}
+
+/*
+ * Same for a pair of doublewords, the low one at P.  There is no host
+ * 128-bit cmpxchg to rely on, but the callers hold the page against every
+ * other writer, and each doubleword is still stored single-copy atomic.
+ */
+static bool x_monitor_cmpxchg_pair(void *p, uint64_t cmplo, uint64_t cmphi,
+                                   uint64_t newlo, uint64_t newhi,
+                                   TCGMemOp memop)
+{
+    uint64_t *q = p;
+
+    if (memop & MO_BSWAP) {
+        cmplo = bswap64(cmplo);
+        cmphi = bswap64(cmphi);
+        newlo = bswap64(newlo);
+        newhi = bswap64(newhi);
+    }
+    if (atomic_read__nocheck(&q[0]) != cmplo ||
+        atomic_read__nocheck(&q[1]) != cmphi) {
+        return false;
+    }
+    atomic_set__nocheck(&q[0], newlo);
+    atomic_set__nocheck(&q[1], newhi);
+    return true;
+}
+
+/*
+ * Host memory image of the MEMOP-sized value V, as x_monitor_cmpxchg
+ * would compare or store it.
+ */
+static void x_monitor_image(void *buf, uint64_t v, TCGMemOp memop)
+{
+    bool bswap = memop & MO_BSWAP;
+
+    switch (memop & MO_SIZE) {
+    case MO_8:
+        stb_p(buf, v);
+        break;
+    case MO_16:
+        stw_he_p(buf, bswap ? bswap16(v) : v);
+        break;
+    case MO_32:
+        stl_he_p(buf, bswap ? bswap32(v) : v);
+        break;
+    case MO_64:
+        stq_he_p(buf, bswap ? bswap64(v) : v);
+        break;
+    default:
+        g_assert_not_reached();
+    }
+}
+
+/*
+ * PST store-conditional.  Returns the status the guest sees: 0 if the
+ * store was done, 1 if the reservation was lost or memory changed.
+ */
+static uint64_t x_monitor_do_sc(CPUArchState *env, target_ulong addr,
+                                uint64_t cmplo, uint64_t cmphi,
+                                uint64_t newlo, uint64_t newhi,
+                                TCGMemOp memop, bool pair)
+{
+    TaskState *ts = env_cpu(env)->opaque;
+    void *haddr = g2h(addr);
+    void *pold, *pnew, *p;
+    int pst_state;
+    bool ok;
+
+    trace_llsc_sc(ts->ts_tid, addr, cmplo, newlo);
+
+    /*
+     * Fast path: the page aliases the shadow, so store through the
+     * writable alias while the primary view stays read-only.  Holding
+     * the page's monitor entry orders us against the fault handler,
+     * which breaks the reservations under the same lock before it
+     * unprotects the page.
+     */
+    if (guest_shadow_page(addr)) {
+        XMonitorPage *pd;
+
+        if (llsc_uses_rtm()) {
+            uint64_t cmpi[2], newi[2];
+            int len = pair ? 16 : 1 << (memop & MO_SIZE);
+
+            x_monitor_image(&cmpi[0], cmplo, memop);
+            x_monitor_image(&newi[0], newlo, memop);
+            if (pair) {
+                x_monitor_image(&cmpi[1], cmphi, memop);
+                x_monitor_image(&newi[1], newhi, memop);
+            }
+            /* The transaction counts its own outcome.  */
+            switch (x_monitor_rtm_sc(ts->x_monitor_node, addr,
+                                     g2shadow(addr), len, cmpi, newi,
+                                     NULL, NULL)) {
+            case XMON_RTM_STORED:
+                return 0;
+            case XMON_RTM_FAILED:
+                return 1;
+            case XMON_RTM_FALLBACK:
+                break;
+            }
+        }
+
+        pd = x_monitor_page_lock(addr);
+        ok = x_monitor_check_exclusive(ts->x_monitor_node, addr);
+        if (!ok) {
+            x_monitor_page_unlock(pd);
+            llsc_stat_sc(LLSC_STAT_SC_FAIL_LOST);
+            return 1;
+        }
+        x_monitor_clean_locked(pd);
+        p = g2shadow(addr);
+        ok = pair ? x_monitor_cmpxchg_pair(p, cmplo, cmphi,
+                                           newlo, newhi, memop)
+                  : x_monitor_cmpxchg(p, cmplo, newlo, memop);
+        x_monitor_page_unlock(pd);
+        llsc_stat_sc(ok ? LLSC_STAT_SC_OK : LLSC_STAT_SC_FAIL_VALUE);
+        return !ok;
+    }
+
+    x_monitor_sc_lock();
+
+    if (!x_monitor_check_exclusive(ts->x_monitor_node, addr)) {
+        x_monitor_sc_unlock();
+        trace_llsc_sc_lost(ts->ts_tid, addr);
+        llsc_stat_sc(LLSC_STAT_SC_FAIL_LOST);
+        return 1;
+    }
+    x_monitor_check_and_clean(ts->ts_tid, addr);
+
+    /*
+     * Move the host page aside so that the store goes through a writable
+     * mapping nobody else can see, then put it back.  Accesses that fault
+     * on the missing page meanwhile are retried by the fault handler.
+     */
+    pold = (void *)((uintptr_t)haddr & qemu_host_page_mask);
+    pnew = mmap(NULL, qemu_host_page_size, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (pnew == MAP_FAILED) {
+        /* The reservation is already gone; a spurious failure is allowed. */
+        x_monitor_sc_unlock();
+        trace_llsc_sc_lost(ts->ts_tid, addr);
+        llsc_stat_sc(LLSC_STAT_SC_FAIL_LOST);
+        return 1;
+    }
+    pst_state = x_monitor_pst_hold(addr);
+    p = mremap(pold, qemu_host_page_size, qemu_host_page_size,
+               MREMAP_FIXED | MREMAP_MAYMOVE, pnew);
+    if (p == MAP_FAILED) {
+        /* Nothing moved, so just fail like above.  */
+        munmap(pnew, qemu_host_page_size);
+        x_monitor_pst_release(addr, pst_state);
+        x_monitor_sc_unlock();
+        trace_llsc_sc_lost(ts->ts_tid, addr);
+        llsc_stat_sc(LLSC_STAT_SC_FAIL_LOST);
+        return 1;
+    }
+    mprotect(pnew, qemu_host_page_size, PROT_READ | PROT_WRITE);
+    llsc_stat_inc(LLSC_STAT_MPROTECT);
+
+    p = (char *)pnew + ((char *)haddr - (char *)pold);
+    ok = pair ? x_monitor_cmpxchg_pair(p, cmplo, cmphi, newlo, newhi, memop)
+              : x_monitor_cmpxchg(p, cmplo, newlo, memop);
+
+    p = mremap(pnew, qemu_host_page_size, qemu_host_page_size,
+               MREMAP_FIXED | MREMAP_MAYMOVE, pold);
+    if (p != pold) {
+        /* The guest page is stranded at PNEW; there is no way back.  */
+        fprintf(stderr, "qemu: cannot move back guest page 0x"
+                TARGET_FMT_lx " after a store-conditional: %s\n",
+                addr & qemu_host_page_mask, strerror(errno));
+        abort();
+    }
+    /* The page came back writable; release restores its protection.  */
+    x_monitor_pst_release(addr, pst_state);
+    x_monitor_sc_unlock();
+    llsc_stat_sc(ok ? LLSC_STAT_SC_OK : LLSC_STAT_SC_FAIL_VALUE);
+    return !ok;
+}
+
+/*
+ * The shadow alias and the bounce page of the slow path are always
+ * writable, so the guest protection is checked here as a plain store
+ * would see it: a page the guest cannot write faults, and the
+ * translations of a code page are invalidated once it is written.
+ *
+ * Whatever the outcome, the reservation is gone, and the page may be
+ * left protected with nobody reserving it: have it unprotected when the
+ * thread next leaves the translated code, instead of by a fault.
+ */
+static uint64_t x_monitor_sc(CPUArchState *env, target_ulong addr,
+                             uint64_t cmplo, uint64_t cmphi,
+                             uint64_t newlo, uint64_t newhi,
+                             TCGMemOp memop, bool pair, uintptr_t ra)
+{
+    CPUState *cs = env_cpu(env);
+    TaskState *ts = cs->opaque;
+    int len = pair ? 16 : 1 << (memop & MO_SIZE);
+    int flags = page_get_flags(addr);
+    uint64_t status;
+
+    if (!(flags & PAGE_WRITE_ORG)) {
+        x_monitor_clear_exclusive(ts->x_monitor_node);
+        CPU_GET_CLASS(cs)->tlb_fill(cs, addr, len, MMU_DATA_STORE,
+                                    MMU_USER_IDX, false, ra);
+        g_assert_not_reached();
+    }
+
+    status = x_monitor_do_sc(env, addr, cmplo, cmphi, newlo, newhi,
+                             memop, pair);
+    if (status == 0 && !(flags & PAGE_WRITE)) {
+        mmap_lock();
+        tb_invalidate_phys_range(addr, addr + len);
+        mmap_unlock();
+    }
+
+    x_monitor_pst_defer(addr);
+    return status;
+}
+
+uint64_t HELPER(llsc_sc)(CPUArchState *env, target_ulong addr,
+                         uint64_t cmpv, uint64_t newv, uint32_t memop)
+{
+    return x_monitor_sc(env, addr, cmpv, 0, newv, 0, memop, false, GETPC());
+}
+
+uint64_t HELPER(llsc_sc_pair_le)(CPUArchState *env, target_ulong addr,
+                                 uint64_t cmplo, uint64_t cmphi,
+                                 uint64_t newlo, uint64_t newhi)
+{
+    return x_monitor_sc(env, addr, cmplo, cmphi, newlo, newhi,
+                        MO_64 | MO_LE, true, GETPC());
+}
+
+uint64_t HELPER(llsc_sc_pair_be)(CPUArchState *env, target_ulong addr,
+                                 uint64_t cmplo, uint64_t cmphi,
+                                 uint64_t newlo, uint64_t newhi)
+{
+    return x_monitor_sc(env, addr, cmplo, cmphi, newlo, newhi,
+                        MO_64 | MO_BE, true, GETPC());
+}
@@ -121,6 +121,20 @@ DEF_HELPER_FLAGS_4(atomic_cmpxchgq_le, TCG_CALL_NO_WG, i64, env, tl, i64, i64)
 
 #endif /* CONFIG_SOFTMMU */
 
+#ifdef CONFIG_LINUX_USER
+DEF_HELPER_FLAGS_2(llsc_reserve, TCG_CALL_NO_WG, void, env, tl)
+DEF_HELPER_FLAGS_1(llsc_clrex, TCG_CALL_NO_RWG, void, env)
+DEF_HELPER_FLAGS_5(llsc_sc, TCG_CALL_NO_WG, i64, env, tl, i64, i64, i32)
+DEF_HELPER_FLAGS_6(llsc_sc_pair_le, TCG_CALL_NO_WG,
+                   i64, env, tl, i64, i64, i64, i64)
+DEF_HELPER_FLAGS_6(llsc_sc_pair_be, TCG_CALL_NO_WG,
+                   i64, env, tl, i64, i64, i64, i64)
+DEF_HELPER_FLAGS_1(llsc_stat, TCG_CALL_NO_RWG, void, i32)
+DEF_HELPER_FLAGS_1(llsc_stat_sc, TCG_CALL_NO_RWG, void, i64)
+DEF_HELPER_FLAGS_1(llsc_profile_ll, TCG_CALL_NO_RWG, void, tl)
+DEF_HELPER_FLAGS_2(llsc_profile_sc, TCG_CALL_NO_RWG, void, tl, i64)
+#endif
+
 GEN_ATOMIC_HELPERS(fetch_add)
 GEN_ATOMIC_HELPERS(fetch_and)
 GEN_ATOMIC_HELPERS(fetch_or)
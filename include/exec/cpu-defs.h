@@ -237,7 +237,17 @@ typedef struct CPUTLB { } CPUTLB;
  */
 typedef struct CPUNegativeOffsetState {
     CPUTLB tlb;
+#ifdef CONFIG_LINUX_USER
+    /* This thread's LL/SC reservation, see linux-user/x-monitor.h.  */
+    target_ulong *llsc_addr;
+#endif
     IcountDecr icount_decr;
 } CPUNegativeOffsetState;
 
+#ifdef CONFIG_LINUX_USER
+/* This will be used by TCG backends to probe the reservation inline.  */
+#define LLSC_ADDR_OFS \
+    ((int)offsetof(ArchCPU, neg.llsc_addr) - (int)offsetof(ArchCPU, env))
+#endif
+
 #endif
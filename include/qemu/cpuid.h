@@ -48,6 +48,14 @@
 #ifndef bit_BMI2
 #define bit_BMI2        (1 << 8)
 #endif
+#ifndef bit_RTM
+#define bit_RTM         (1 << 11)
+#endif
+
+/* Leaf 7, %edx */
+#ifndef bit_RTM_ALWAYS_ABORT
+#define bit_RTM_ALWAYS_ABORT (1 << 11)
+#endif
 
 /* Leaf 0x80000001, %ecx */
 #ifndef bit_LZCNT
@@ -21,6 +21,7 @@
 #include "qemu-common.h"
 #include "qemu.h"
 #include "cpu_loop-common.h"
+#include "x-monitor.h"
 #include "qemu/guest-random.h"
 
 #define get_user_code_u32(x, gaddr, env)                \
@@ -83,6 +84,8 @@ void cpu_loop(CPUARMState *env)
         cpu_exec_start(cs);
         trapnr = cpu_exec(cs);
         cpu_exec_end(cs);
+        /* idle PST pages left protected by store-exclusives */
+        x_monitor_pst_flush();
         process_queued_cpu_work(cs);
 
         switch (trapnr) {
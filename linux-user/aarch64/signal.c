@@ -19,6 +19,7 @@
 #include "qemu/osdep.h"
 #include "qemu.h"
 #include "signal-common.h"
+#include "../arm/x-monitor-arm.h"
 #include "linux-user/trace.h"
 
 struct target_sigcontext {
@@ -528,12 +529,14 @@ void setup_rt_frame(int sig, struct target_sigaction *ka,
                     target_siginfo_t *info, target_sigset_t *set,
                     CPUARMState *env)
 {
+    arm_clear_exclusive(env);
     target_setup_frame(sig, ka, info, set, env);
 }
 
 void setup_frame(int sig, struct target_sigaction *ka,
                  target_sigset_t *set, CPUARMState *env)
 {
+    arm_clear_exclusive(env);
     target_setup_frame(sig, ka, 0, set, env);
 }
 
@@ -542,6 +545,7 @@ long do_rt_sigreturn(CPUARMState *env)
     struct target_rt_sigframe *frame = NULL;
     abi_ulong frame_addr = env->xregs[31];
 
+    arm_clear_exclusive(env);
     trace_user_do_rt_sigreturn(env, frame_addr);
     if (frame_addr & 15) {
         goto badframe;
@@ -22,6 +22,8 @@
 #include "qemu.h"
 #include "elf.h"
 #include "cpu_loop-common.h"
+#include "x-monitor.h"
+#include "llsc-profile.h"
 
 #define get_user_code_u32(x, gaddr, env)                \
     ({ abi_long __r = get_user_u32((x), (gaddr));       \
@@ -71,10 +73,6 @@
         put_user_u16(__x, (gaddr));                     \
     })
 
-//#define HASH_LLSC
-//#define LLSC_LOG
-//#define PICO_ST_LLSC
-#define PF_LLSC
 /* Commpage handling -- there is no commpage for AArch64 */
 
 /*
@@ -209,65 +207,240 @@ do_kernel_trap(CPUARMState *env)
     return 0;
 }
 
-/* Load exclusive handling for AArch32 */
+/* Guest memory image of the SIZE-coded value VAL of an exclusive.  */
+static void exclusive_image(void *buf, int size, uint64_t val)
+{
+    switch (size) {
+    case 0:
+        stb_p(buf, val);
+        break;
+    case 1:
+        stw_p(buf, val);
+        break;
+    case 2:
+        stl_p(buf, val);
+        break;
+    case 3:
+        stl_p(buf, val);
+        stl_p((char *)buf + 4, val >> 32);
+        break;
+    default:
+        abort();
+    }
+}
+
+/*
+ * Single-copy atomic load of the SIZE-coded exclusive at ADDR; the two
+ * words of a doubleword are read together.
+ */
+static int exclusive_load(uint32_t addr, int size, uint64_t *val)
+{
+    int len = size == 3 ? 8 : 1 << size;
+    void *host;
+    uint64_t img;
+
+    if (!access_ok(VERIFY_READ, addr, len)) {
+        return -TARGET_EFAULT;
+    }
+    host = g2h(addr);
+    switch (size) {
+    case 0:
+        *val = atomic_read((uint8_t *)host);
+        break;
+    case 1:
+        *val = lduw_p(host);
+        break;
+    case 2:
+        *val = ldl_p(host);
+        break;
+    case 3:
+        img = atomic_read__nocheck((uint64_t *)host);
+        *val = deposit64(ldl_p(&img), 32, 32, ldl_p((char *)&img + 4));
+        break;
+    default:
+        abort();
+    }
+    return 0;
+}
+
+/* Store NEWV at HOST if it still holds CMPV, both SIZE-coded.  */
+static bool exclusive_cmpxchg(void *host, int size, uint64_t cmpv,
+                              uint64_t newv)
+{
+    uint64_t ci, ni;
+
+    exclusive_image(&ci, size, cmpv);
+    exclusive_image(&ni, size, newv);
+    switch (size) {
+    case 0:
+        return atomic_cmpxchg((uint8_t *)host, ldub_p(&ci), ldub_p(&ni))
+               == ldub_p(&ci);
+    case 1:
+        return atomic_cmpxchg((uint16_t *)host, lduw_he_p(&ci),
+                              lduw_he_p(&ni)) == lduw_he_p(&ci);
+    case 2:
+        return atomic_cmpxchg((uint32_t *)host, ldl_he_p(&ci),
+                              ldl_he_p(&ni)) == ldl_he_p(&ci);
+    case 3:
+        return atomic_cmpxchg__nocheck((uint64_t *)host, ci, ni) == ci;
+    default:
+        abort();
+    }
+}
+
+/*
+ * Load exclusive handling for AArch32.
+ *
+ * Under excp, exclusives no longer stop the world.  The reservation is
+ * kept in the x-monitor like PST's, and the lock of its page entry orders
+ * a store-exclusive against every other one on the page.  The handlers
+ * still run between cpu_exec_start() and cpu_exec_end(), so that
+ * start_exclusive() users such as __kernel_cmpxchg wait for them.
+ *
+ * Under hst the other threads are still stopped.  A translated store tags
+ * the hash table and writes the guest word as two separate host stores,
+ * so only a quiescent world keeps it from landing between the tag check
+ * and the compare-and-swap of a store-exclusive.  It also guarantees that
+ * a store to a page being marked has either completed or will see the
+ * mark, which gen_llsc_hash_tag relies on to sink unmarked stores.
+ */
+static void exclusive_enter(CPUState *cs)
+{
+    if (llsc_scheme == LLSC_HST) {
+        start_exclusive();
+    } else {
+        cpu_exec_start(cs);
+    }
+}
+
+static void exclusive_leave(CPUState *cs)
+{
+    if (llsc_scheme == LLSC_HST) {
+        end_exclusive();
+    } else {
+        cpu_exec_end(cs);
+    }
+}
+
 static int do_ldrex(CPUARMState *env)
 {
+    CPUState *cs = env_cpu(env);
+    TaskState *ts = cs->opaque;
     uint64_t val;
-    int segv = 0;
+    int size;
+    int segv;
     uint32_t addr;
-#ifdef HASH_LLSC
-	uint32_t hash_addr;
-#endif
-    //fprintf(stderr, "do_ldrex\n");
-    start_exclusive();
+
+    exclusive_enter(cs);
+    llsc_stat_inc(LLSC_STAT_LL);
+    llsc_profile_add(env->regs[15], LLSC_PROF_LL, 1);
 
     addr = env->exclusive_addr;
+    size = (env->exclusive_info >> 8) & 0xf;
+
+    /* Reserve and tag before loading, so that no store can slip between.  */
+    x_monitor_set_exclusive_addr(ts->x_monitor_node, addr);
+    if (llsc_scheme == LLSC_HST) {
+        llsc_hash_mark_page(addr);
+        atomic_set(llsc_hash_entry(addr), env->exclusive_tid);
+        if (size == 3) {
+            atomic_set(llsc_hash_entry(addr + 4), env->exclusive_tid);
+        }
+    }
 
-    segv = get_user_u32(val, addr);
-	assert(segv == 0);
-	env->exclusive_val = val;
+    segv = exclusive_load(addr, size, &val);
+    if (segv) {
+        /* Unmapped, maybe by another thread: the caller raises SIGSEGV.  */
+        x_monitor_clear_exclusive(ts->x_monitor_node);
+        env->exception.vaddress = addr;
+        goto done;
+    }
+    if (size == 3) {
+        env->regs[(env->exclusive_info >> 4) & 0xf] = val >> 32;
+    }
+    env->exclusive_val = val;
 
-#ifdef HASH_LLSC
-	hash_addr = (addr & 0x0fffffff) | 0xa0000000;
-    segv = put_user_u32(env->exclusive_tid, hash_addr);
-	assert(segv == 0);
-#endif
-	
     env->regs[15] += 4;
-    env->regs[(env->exclusive_info) & 0xf] = val;
-	//fprintf(stderr, "ldrex reg = %d, reg15 = %d, val = %ld!, addr = %x\n",
-	//		(env->exclusive_info) & 0xf , env->regs[15], val, addr);
+    env->regs[(env->exclusive_info) & 0xf] = (uint32_t)val;
 
-#ifdef LLSC_LOG
-	fprintf(stderr, "thread %d ldrex done! val %lx, addr %x\n", env->exclusive_tid, env->exclusive_val, addr);
-#endif
-    end_exclusive();
+    qemu_log_mask(CPU_LOG_LLSC, "thread %d ldrex done! val %" PRIx64
+                  ", addr %x\n", env->exclusive_tid, env->exclusive_val, addr);
+done:
+    exclusive_leave(cs);
     return segv;
 }
 
-#ifdef PF_LLSC
-extern int x_monitor_check_exclusive(void* p_node, uint32_t addr);
-extern int x_monitor_check_and_clean(int tid, uint32_t addr);
-#endif
-/* Store exclusive handling for AArch32 */
+/*
+ * Store exclusive as a hardware transaction.  Returns false if there is
+ * no verdict and the caller must take the page entry lock instead.
+ */
+static bool do_strex_rtm(CPUARMState *env)
+{
+    TaskState *ts = env_cpu(env)->opaque;
+    uint32_t addr = env->exclusive_addr;
+    int size = env->exclusive_info & 0xf;
+    int len = size == 3 ? 8 : 1 << size;
+    uint64_t newv = env->regs[(env->exclusive_info >> 8) & 0xf];
+    uint32_t *tag = NULL, *tag_hi = NULL;
+    uint64_t cmpi, newi;
+    XMonitorRTMResult res;
+
+    /* Failures and faults are left to the slow path.  */
+    if (env->exclusive_addr != env->exclusive_test ||
+        !access_ok(VERIFY_WRITE, addr, len)) {
+        return false;
+    }
+    if (size == 3) {
+        newv = deposit64(newv, 32, 32,
+                         env->regs[(env->exclusive_info >> 12) & 0xf]);
+    }
+    exclusive_image(&cmpi, size, env->exclusive_val);
+    exclusive_image(&newi, size, newv);
+    if (llsc_scheme == LLSC_HST) {
+        tag = llsc_hash_entry(addr);
+        if (size == 3) {
+            tag_hi = llsc_hash_entry(addr + 4);
+        }
+    }
+
+    res = x_monitor_rtm_sc(ts->x_monitor_node, addr, g2h(addr), len,
+                           &cmpi, &newi, tag, tag_hi);
+    if (res == XMON_RTM_FALLBACK) {
+        return false;
+    }
+    qemu_log_mask(CPU_LOG_LLSC, "thread %d strex %s (rtm), addr %x\n",
+                  env->exclusive_tid,
+                  res == XMON_RTM_STORED ? "suc!" : "fail!", addr);
+    env->regs[15] += 4;
+    env->regs[(env->exclusive_info >> 4) & 0xf] = res != XMON_RTM_STORED;
+    return true;
+}
+
+/* Store exclusive handling for AArch32, see do_ldrex.  */
 static int do_strex(CPUARMState *env)
 {
+    CPUState *cs = env_cpu(env);
+    TaskState *ts = cs->opaque;
+    uint32_t pc = env->regs[15];
+    XMonitorPage *pd;
     uint64_t val;
     int size;
     int rc = 1;
     int segv = 0;
     uint32_t addr;
-#ifdef HASH_LLSC
-	uint32_t hash_addr;
-	uint32_t hash_entry;
-#endif
-    //fprintf(stderr, "[do_strex]\tdo_strex\n");
-    start_exclusive();
+    uint32_t hash_entry = env->exclusive_tid;
+    bool reserved, ok;
+
+    exclusive_enter(cs);
+
+    if (llsc_uses_rtm() && do_strex_rtm(env)) {
+        goto done;
+    }
 
     if (env->exclusive_addr != env->exclusive_test) {
-#ifdef LLSC_LOG
-		fprintf(stderr, "thread %d strex fail! val %lx, oldval %lx\n", env->exclusive_tid, val, env->exclusive_val);
-#endif
+        qemu_log_mask(CPU_LOG_LLSC, "thread %d strex fail! address "
+                      "mismatch\n", env->exclusive_tid);
+        llsc_stat_sc(LLSC_STAT_SC_FAIL_ADDR);
         goto fail;
     }
     /* We know we're always AArch32 so the address is in uint32_t range
@@ -276,105 +449,67 @@ static int do_strex(CPUARMState *env)
      */
     assert(extract64(env->exclusive_addr, 32, 32) == 0);
     addr = env->exclusive_addr;
-#ifdef PF_LLSC
-	target_ulong page_addr = addr & 0xfffff000;
-	target_mprotect(page_addr, 0x1000, PROT_READ|PROT_WRITE);
-	//target_mremap();
-	if (x_monitor_check_exclusive((void*)env->exclusive_node, addr) != 1) {
-#ifdef LLSC_LOG
-		fprintf(stderr, "thread %d strex fail! val %lx, oldval %lx, exclusive mark lost.\n", env->exclusive_tid, val, env->exclusive_val);
-#endif
-		goto fail;
-	}
-#endif
-#ifdef HASH_LLSC
-	hash_addr = (addr & 0x0fffffff) | 0xa0000000;
-	segv = get_user_u32(hash_entry, hash_addr);
-	assert(segv == 0);
-	if (hash_entry != env->exclusive_tid) {
-
-#ifdef LLSC_LOG
-		fprintf(stderr, "thread %d strex fail! val %lx, oldval %lx, hash_entry %x, addr %x\n", env->exclusive_tid, val, env->exclusive_val, hash_entry, addr);
-#endif
-        goto fail;
-    }
-
-#endif
-	
     size = env->exclusive_info & 0xf;
-    switch (size) {
-    case 0:
-        segv = get_user_u8(val, addr);
-        break;
-    case 1:
-        segv = get_user_u16(val, addr);
-        break;
-    case 2:
-    case 3:
-        segv = get_user_u32(val, addr);
-        break;
-    default:
-        abort();
-    }
-    if (segv) {
+    if (!access_ok(VERIFY_WRITE, addr, size == 3 ? 8 : 1 << size)) {
         env->exception.vaddress = addr;
+        segv = -TARGET_EFAULT;
         goto done;
     }
+
+    val = env->regs[(env->exclusive_info >> 8) & 0xf];
     if (size == 3) {
-        uint32_t valhi;
-        segv = get_user_u32(valhi, addr + 4);
-        if (segv) {
-            env->exception.vaddress = addr + 4;
-            goto done;
+        val = deposit64(val, 32, 32,
+                        env->regs[(env->exclusive_info >> 12) & 0xf]);
+    }
+
+    pd = x_monitor_page_lock(addr);
+    reserved = x_monitor_check_exclusive(ts->x_monitor_node, addr);
+    if (reserved && llsc_scheme == LLSC_HST) {
+        hash_entry = atomic_read(llsc_hash_entry(addr));
+        if (size == 3 && hash_entry == env->exclusive_tid) {
+            /* A store to either word breaks a doubleword reservation.  */
+            hash_entry = atomic_read(llsc_hash_entry(addr + 4));
         }
-        val = deposit64(val, 32, 32, valhi);
     }
-    if (val != env->exclusive_val) {
-#ifdef LLSC_LOG
-	fprintf(stderr, "thread %d strex fail! val %lx, oldval %lx, addr %x\n", env->exclusive_tid, val, env->exclusive_val, addr);
-#endif
-        goto fail;
+    ok = reserved && hash_entry == env->exclusive_tid;
+    if (ok) {
+        x_monitor_clean_locked(pd);
+        ok = exclusive_cmpxchg(g2h(addr), size, env->exclusive_val, val);
     }
+    x_monitor_page_unlock(pd);
 
-    val = env->regs[(env->exclusive_info >> 8) & 0xf];
-#ifdef LLSC_LOG
-	fprintf(stderr, "thread %d strex suc! newval %lx, oldval %lx, addr %x\n", env->exclusive_tid, val, env->exclusive_val, addr);
-#endif
-#ifdef PF_LLSC
-	x_monitor_check_and_clean(env->exclusive_tid, addr);
-#endif
-    switch (size) {
-    case 0:
-        segv = put_user_u8(val, addr);
-        break;
-    case 1:
-        segv = put_user_u16(val, addr);
-        break;
-    case 2:
-    case 3:
-        segv = put_user_u32(val, addr);
-        break;
+    if (!reserved) {
+        qemu_log_mask(CPU_LOG_LLSC, "thread %d strex fail! reservation "
+                      "lost, addr %x\n", env->exclusive_tid, addr);
+        llsc_stat_sc(LLSC_STAT_SC_FAIL_LOST);
+        goto fail;
     }
-    if (segv) {
-		assert(segv);
-        env->exception.vaddress = addr;
-        goto done;
+    if (hash_entry != env->exclusive_tid) {
+        qemu_log_mask(CPU_LOG_LLSC, "thread %d strex fail! hash_entry "
+                      "%x, addr %x\n", env->exclusive_tid, hash_entry, addr);
+        llsc_stat_sc(LLSC_STAT_SC_FAIL_LOST);
+        goto fail;
     }
-    if (size == 3) {
-        val = env->regs[(env->exclusive_info >> 12) & 0xf];
-        segv = put_user_u32(val, addr + 4);
-        if (segv) {
-            env->exception.vaddress = addr + 4;
-            goto done;
-        }
+    if (!ok) {
+        qemu_log_mask(CPU_LOG_LLSC, "thread %d strex fail! oldval %" PRIx64
+                      " changed, addr %x\n", env->exclusive_tid,
+                      env->exclusive_val, addr);
+        llsc_stat_sc(LLSC_STAT_SC_FAIL_VALUE);
+        goto fail;
     }
+    qemu_log_mask(CPU_LOG_LLSC, "thread %d strex suc! newval %" PRIx64
+                  ", oldval %" PRIx64 ", addr %x\n", env->exclusive_tid,
+                  val, env->exclusive_val, addr);
+    llsc_stat_sc(LLSC_STAT_SC_OK);
     rc = 0;
 fail:
     env->regs[15] += 4;
     env->regs[(env->exclusive_info >> 4) & 0xf] = rc;
-	
 done:
-    end_exclusive();
+    if (!segv) {
+        llsc_profile_sc(pc, env->regs[(env->exclusive_info >> 4) & 0xf]);
+    }
+    exclusive_leave(cs);
     return segv;
 }
 
@@ -387,10 +522,15 @@ void cpu_loop(CPUARMState *env)
     uint32_t addr;
     abi_ulong ret;
 
+    /* The hst scheme tags the hash table with this id.  */
+    env->exclusive_tid = ((TaskState *)cs->opaque)->ts_tid;
+
     for(;;) {
         cpu_exec_start(cs);
         trapnr = cpu_exec(cs);
         cpu_exec_end(cs);
+        /* idle PST pages left protected by store-exclusives */
+        x_monitor_pst_flush();
         process_queued_cpu_work(cs);
 
         switch(trapnr) {
@@ -559,6 +699,7 @@ void cpu_loop(CPUARMState *env)
             break;
         case EXCP_PREFETCH_ABORT:
         case EXCP_DATA_ABORT:
+        data_abort:
             addr = env->exception.vaddress;
             {
                 info.si_signo = TARGET_SIGSEGV;
@@ -586,19 +727,16 @@ void cpu_loop(CPUARMState *env)
         case EXCP_ATOMIC:
             cpu_exec_step_atomic(cs);
             break;
-		case EXCP_LDREX:
-			if (!do_ldrex(env)) {
-				break;
-			}
-			else {
-				EXCP_DUMP(env, "qemu: unhandled CPU exception 0x%x - aborting\n", trapnr);
-            	abort();
-			}
-		case EXCP_STREX:
+        case EXCP_LDREX:
+            if (!do_ldrex(env)) {
+                break;
+            }
+            goto data_abort;
+        case EXCP_STREX:
             if (!do_strex(env)) {
                 break;
             }
-            /* fall through for segv */
+            goto data_abort;
         default:
         error:
             EXCP_DUMP(env, "qemu: unhandled CPU exception 0x%x - aborting\n", trapnr);
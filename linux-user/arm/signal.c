@@ -19,6 +19,7 @@
 #include "qemu/osdep.h"
 #include "qemu.h"
 #include "signal-common.h"
+#include "x-monitor-arm.h"
 #include "linux-user/trace.h"
 
 struct target_sigcontext {
@@ -420,6 +421,7 @@ sigsegv:
 void setup_frame(int usig, struct target_sigaction *ka,
                  target_sigset_t *set, CPUARMState *regs)
 {
+    arm_clear_exclusive(regs);
     if (get_osversion() >= 0x020612) {
         setup_frame_v2(usig, ka, set, regs);
     } else {
@@ -514,6 +516,7 @@ void setup_rt_frame(int usig, struct target_sigaction *ka,
                     target_siginfo_t *info,
                     target_sigset_t *set, CPUARMState *env)
 {
+    arm_clear_exclusive(env);
     if (get_osversion() >= 0x020612) {
         setup_rt_frame_v2(usig, ka, info, set, env);
     } else {
@@ -737,6 +740,7 @@ badframe:
 
 long do_sigreturn(CPUARMState *env)
 {
+    arm_clear_exclusive(env);
     if (get_osversion() >= 0x020612) {
         return do_sigreturn_v2(env);
     } else {
@@ -827,6 +831,7 @@ badframe:
 
 long do_rt_sigreturn(CPUARMState *env)
 {
+    arm_clear_exclusive(env);
     if (get_osversion() >= 0x020612) {
         return do_rt_sigreturn_v2(env);
     } else {
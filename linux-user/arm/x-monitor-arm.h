@@ -0,0 +1,35 @@
+/*
+ * Exclusive monitor helpers shared by the arm and aarch64 linux-user code
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef LINUX_USER_ARM_X_MONITOR_ARM_H
+#define LINUX_USER_ARM_X_MONITOR_ARM_H
+
+#include "x-monitor.h"
+
+/*
+ * The kernel clears the exclusive monitor on every exception return, so
+ * an exclusive sequence interrupted by a signal, or by the return from
+ * its handler, always fails.  The generic signal code drops the monitor
+ * reservation; this clears the address the excp and hst schemes and the
+ * cmpxchg path compare against.
+ */
+static inline void arm_clear_exclusive(CPUARMState *env)
+{
+    env->exclusive_addr = -1;
+}
+
+#endif
@@ -9,6 +9,7 @@
 #include "disas/disas.h"
 #include "qemu/path.h"
 #include "qemu/guest-random.h"
+#include "llsc-profile.h"
 
 #ifdef _ARCH_PPC64
 #undef ARCH_DLINFO
@@ -2502,7 +2503,7 @@ static void load_elf_image(const char *image_name, int image_fd,
         info->brk = info->end_code;
     }
 
-    if (qemu_log_enabled()) {
+    if (qemu_log_enabled() || llsc_profile_enabled()) {
         load_symbols(ehdr, image_fd, load_bias);
     }
 
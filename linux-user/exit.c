@@ -18,6 +18,8 @@
  */
 #include "qemu/osdep.h"
 #include "qemu.h"
+#include "x-monitor.h"
+#include "llsc-profile.h"
 #ifdef TARGET_GPROF
 #include <sys/gmon.h>
 #endif
@@ -26,7 +28,6 @@
 extern void __gcov_dump(void);
 #endif
 
-extern long long llsc_single, llsc_multi;
 void preexit_cleanup(CPUArchState *env, int code)
 {
 #ifdef TARGET_GPROF
@@ -35,6 +36,7 @@ void preexit_cleanup(CPUArchState *env, int code)
 #ifdef CONFIG_GCOV
         __gcov_dump();
 #endif
-		fprintf(stderr, "[x_mon]\tllsc_single=%lld, llsc_multi=%lld\n", llsc_single, llsc_multi);
+        x_monitor_stats_report();
+        llsc_profile_report();
         gdb_exit(env, code);
 }
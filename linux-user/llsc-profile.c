@@ -0,0 +1,274 @@
+/*
+ * Per-PC profile of guest exclusive accesses
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/atomic.h"
+#include "qemu/xxhash.h"
+#include "disas/disas.h"
+#include "exec/exec-all.h"
+#include "tcg.h"
+
+#include "qemu.h"
+#include "llsc-profile.h"
+
+const char *llsc_profile_path;
+
+/*
+ * Open-addressed table keyed by guest PC.  A slot is claimed with a
+ * cmpxchg on its key and never released, and counters are bumped with
+ * atomic adds, so recording takes no lock.  Guest PC 0 marks a free
+ * slot; events without a usable PC, or that find the table full, go to
+ * llsc_prof_other.
+ */
+#define LLSC_PROF_BITS 12
+#define LLSC_PROF_SIZE (1 << LLSC_PROF_BITS)
+
+typedef struct LLSCProfEntry {
+    target_ulong pc;
+    uint64_t count[LLSC_PROF__MAX];
+} QEMU_ALIGNED(64) LLSCProfEntry;
+
+static LLSCProfEntry *llsc_prof_table;
+static LLSCProfEntry llsc_prof_other;
+
+/*
+ * PST faults, keyed the same way by the host PC of the faulting store.
+ * Finding the translation block takes the TB tree lock, which the fault
+ * handler must not, so the host PCs are only resolved to guest PCs when
+ * the report is written.  A block flushed by then is charged as "other".
+ */
+typedef struct LLSCProfFault {
+    uintptr_t host_pc;
+    uint64_t count;
+    uint64_t ns;
+} QEMU_ALIGNED(32) LLSCProfFault;
+
+static LLSCProfFault *llsc_prof_faults;
+
+void llsc_profile_init(void)
+{
+    if (llsc_profile_enabled()) {
+        llsc_prof_table = qemu_memalign(sizeof(LLSCProfEntry),
+                                        sizeof(LLSCProfEntry) *
+                                        LLSC_PROF_SIZE);
+        memset(llsc_prof_table, 0, sizeof(LLSCProfEntry) * LLSC_PROF_SIZE);
+        llsc_prof_faults = qemu_memalign(sizeof(LLSCProfFault),
+                                         sizeof(LLSCProfFault) *
+                                         LLSC_PROF_SIZE);
+        memset(llsc_prof_faults, 0, sizeof(LLSCProfFault) * LLSC_PROF_SIZE);
+    }
+}
+
+static LLSCProfEntry *llsc_profile_entry(target_ulong pc)
+{
+    uint32_t h = qemu_xxhash2(pc);
+    int i;
+
+    if (pc == 0) {
+        return &llsc_prof_other;
+    }
+    for (i = 0; i < LLSC_PROF_SIZE; i++) {
+        LLSCProfEntry *e = &llsc_prof_table[(h + i) & (LLSC_PROF_SIZE - 1)];
+        target_ulong key = atomic_read(&e->pc);
+
+        if (key == 0) {
+            key = atomic_cmpxchg(&e->pc, 0, pc);
+            if (key == 0) {
+                return e;
+            }
+        }
+        if (key == pc) {
+            return e;
+        }
+    }
+    return &llsc_prof_other;
+}
+
+void llsc_profile_add(target_ulong pc, LLSCProfEvent ev, uint64_t n)
+{
+    if (llsc_prof_table) {
+        atomic_add(&llsc_profile_entry(pc)->count[ev], n);
+    }
+}
+
+void llsc_profile_sc(target_ulong pc, uint32_t status)
+{
+    LLSCProfEntry *e;
+
+    if (llsc_prof_table) {
+        e = llsc_profile_entry(pc);
+        atomic_inc(&e->count[LLSC_PROF_SC]);
+        if (status) {
+            atomic_inc(&e->count[LLSC_PROF_SC_FAIL]);
+        }
+    }
+}
+
+static LLSCProfFault *llsc_profile_fault_entry(uintptr_t host_pc)
+{
+    uint32_t h = qemu_xxhash2(host_pc);
+    int i;
+
+    for (i = 0; i < LLSC_PROF_SIZE; i++) {
+        LLSCProfFault *f = &llsc_prof_faults[(h + i) & (LLSC_PROF_SIZE - 1)];
+        uintptr_t key = atomic_read(&f->host_pc);
+
+        if (key == 0) {
+            key = atomic_cmpxchg(&f->host_pc, 0, host_pc);
+            if (key == 0) {
+                return f;
+            }
+        }
+        if (key == host_pc) {
+            return f;
+        }
+    }
+    return NULL;
+}
+
+/* Called from the fault handler: no locks, see LLSCProfFault.  */
+void llsc_profile_fault(uintptr_t host_pc, uint64_t ns)
+{
+    LLSCProfFault *f;
+
+    if (llsc_prof_table) {
+        f = host_pc ? llsc_profile_fault_entry(host_pc) : NULL;
+        if (f) {
+            atomic_inc(&f->count);
+            atomic_add(&f->ns, ns);
+        } else {
+            atomic_inc(&llsc_prof_other.count[LLSC_PROF_PST_FAULT]);
+            atomic_add(&llsc_prof_other.count[LLSC_PROF_FAULT_NS], ns);
+        }
+    }
+}
+
+/*
+ * Charge each faulting host PC to the translation block containing it.
+ * A store done by a helper rather than by translated code has no block
+ * and is counted as "other".
+ */
+static void llsc_profile_resolve_faults(void)
+{
+    TranslationBlock *tb;
+    LLSCProfEntry *e;
+    uint64_t n;
+    int i;
+
+    for (i = 0; i < LLSC_PROF_SIZE; i++) {
+        LLSCProfFault *f = &llsc_prof_faults[i];
+
+        if (!atomic_read(&f->host_pc)) {
+            continue;
+        }
+        n = atomic_xchg(&f->count, 0);
+        tb = tcg_tb_lookup(f->host_pc);
+        e = llsc_profile_entry(tb ? tb->pc : 0);
+        atomic_add(&e->count[LLSC_PROF_PST_FAULT], n);
+        atomic_add(&e->count[LLSC_PROF_FAULT_NS], atomic_xchg(&f->ns, 0));
+    }
+}
+
+static uint64_t llsc_profile_cost(const LLSCProfEntry *e)
+{
+    return e->count[LLSC_PROF_SC_FAIL] + e->count[LLSC_PROF_PST_FAULT];
+}
+
+/* Sites with the most failed store-exclusives and faults first.  */
+static int llsc_profile_cmp(const void *a, const void *b)
+{
+    const LLSCProfEntry *ea = *(const LLSCProfEntry * const *)a;
+    const LLSCProfEntry *eb = *(const LLSCProfEntry * const *)b;
+    uint64_t ca = llsc_profile_cost(ea);
+    uint64_t cb = llsc_profile_cost(eb);
+
+    if (ca != cb) {
+        return ca < cb ? 1 : -1;
+    }
+    if (ea->count[LLSC_PROF_LL] != eb->count[LLSC_PROF_LL]) {
+        return ea->count[LLSC_PROF_LL] < eb->count[LLSC_PROF_LL] ? 1 : -1;
+    }
+    return ea->pc < eb->pc ? -1 : ea->pc > eb->pc;
+}
+
+static void llsc_profile_print(FILE *f, const LLSCProfEntry *e)
+{
+    const uint64_t *c = e->count;
+    double fail = c[LLSC_PROF_SC] ?
+                  100.0 * c[LLSC_PROF_SC_FAIL] / c[LLSC_PROF_SC] : 0;
+
+    if (e == &llsc_prof_other) {
+        fprintf(f, "%-18s", "other");
+    } else {
+        fprintf(f, "0x" TARGET_FMT_lx "%*s", e->pc,
+                (int)(16 - 2 * sizeof(target_ulong)), "");
+    }
+    fprintf(f, " %12" PRIu64 " %12" PRIu64 " %12" PRIu64 " %6.2f"
+            " %12" PRIu64 " %12" PRIu64 "  %s\n",
+            c[LLSC_PROF_LL], c[LLSC_PROF_SC], c[LLSC_PROF_SC_FAIL], fail,
+            c[LLSC_PROF_PST_FAULT], c[LLSC_PROF_FAULT_NS] / 1000,
+            e == &llsc_prof_other ? "" : lookup_symbol(e->pc));
+}
+
+void llsc_profile_report(void)
+{
+    LLSCProfEntry **sites;
+    FILE *f;
+    int i, n = 0;
+
+    if (!llsc_prof_table) {
+        return;
+    }
+
+    if (!strcmp(llsc_profile_path, "-")) {
+        f = stderr;
+    } else {
+        f = fopen(llsc_profile_path, "w");
+        if (!f) {
+            fprintf(stderr, "Unable to write LL/SC profile to %s: %s\n",
+                    llsc_profile_path, strerror(errno));
+            return;
+        }
+    }
+
+    /* Threads may still be counting; the dump is only a snapshot.  */
+    llsc_profile_resolve_faults();
+    sites = g_new(LLSCProfEntry *, LLSC_PROF_SIZE);
+    for (i = 0; i < LLSC_PROF_SIZE; i++) {
+        if (atomic_read(&llsc_prof_table[i].pc)) {
+            sites[n++] = &llsc_prof_table[i];
+        }
+    }
+    qsort(sites, n, sizeof(*sites), llsc_profile_cmp);
+
+    fprintf(f, "%-18s %12s %12s %12s %6s %12s %12s  %s\n", "pc", "ll", "sc",
+            "sc_fail", "fail%", "pst_faults", "fault_us", "symbol");
+    for (i = 0; i < n; i++) {
+        llsc_profile_print(f, sites[i]);
+    }
+    for (i = 0; i < LLSC_PROF__MAX; i++) {
+        if (llsc_prof_other.count[i]) {
+            llsc_profile_print(f, &llsc_prof_other);
+            break;
+        }
+    }
+    g_free(sites);
+
+    if (f != stderr) {
+        fclose(f);
+    }
+}
@@ -0,0 +1,53 @@
+/*
+ * Per-PC profile of guest exclusive accesses
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef LINUX_USER_LLSC_PROFILE_H
+#define LINUX_USER_LLSC_PROFILE_H
+
+/*
+ * Enabled with -llsc-profile.  Every event is counted against the guest
+ * PC of the instruction that caused it: the load-exclusive, the
+ * store-exclusive, or for a PST fault the translation block of the
+ * faulting store.  The table is dumped, worst sites first, at exit.
+ */
+typedef enum LLSCProfEvent {
+    LLSC_PROF_LL,
+    LLSC_PROF_SC,
+    LLSC_PROF_SC_FAIL,
+    LLSC_PROF_PST_FAULT,
+    /* time spent in the fault handler */
+    LLSC_PROF_FAULT_NS,
+    LLSC_PROF__MAX,
+} LLSCProfEvent;
+
+/* Path of the report, "-" for stderr; NULL if disabled.  */
+extern const char *llsc_profile_path;
+
+static inline bool llsc_profile_enabled(void)
+{
+    return llsc_profile_path != NULL;
+}
+
+void llsc_profile_init(void);
+void llsc_profile_add(target_ulong pc, LLSCProfEvent ev, uint64_t n);
+/* A store-exclusive at PC that left STATUS in its result register.  */
+void llsc_profile_sc(target_ulong pc, uint32_t status);
+/* A PST fault taken by host code at HOST_PC, handled in NS nanoseconds.  */
+void llsc_profile_fault(uintptr_t host_pc, uint64_t ns);
+void llsc_profile_report(void);
+
+#endif
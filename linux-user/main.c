@@ -20,6 +20,7 @@
 #include "qemu/osdep.h"
 #include "qemu-common.h"
 #include "qemu/units.h"
+#include "qemu/host-utils.h"
 #include "sysemu/tcg.h"
 #include "qemu-version.h"
 #include <sys/syscall.h>
@@ -44,189 +45,11 @@
 #include "target_elf.h"
 #include "cpu_loop-common.h"
 #include "crypto/init.h"
-#include <sys/timeb.h>
+#include "x-monitor.h"
+#include "llsc-profile.h"
 
 /* Globals */
-int ldex_count;
-int stex_count;
-long long llsc_single;
-long long llsc_multi;
-struct timeb t_start, t_multi_start, t_multi_end, t_end;
-long long t_single, t_multi;
-int is_multi;
-int thread_count;
 pthread_mutex_t g_sc_lock;
-#define X_MONITOR
-//#define X_LOG
-#ifdef X_MONITOR
-/* Exclusive Monitor */
-#define PAGE_MASK 0xfffff000
-pthread_mutex_t x_mon_mutex = PTHREAD_MUTEX_INITIALIZER;
-typedef struct x_node {
-	int tid;
-	uint32_t exclusive_addr;
-	uint32_t page_addr;	
-	struct x_node *next;
-} x_node;
-x_node	exclusive_monitor;
-x_node* exclusive_monitor_head = &exclusive_monitor;
-void* x_monitor_register_thread(int tid);
-void x_monitor_show(const char *info);
-int x_monitor_unregister_thread(int tid);
-int x_monitor_set_exclusive_addr(void* p_node, uint32_t addr);
-int x_monitor_check_and_clean(int tid, uint32_t addr);
-int x_monitor_check_exclusive(void* p_node, uint32_t addr);
-
-
-void x_monitor_show(const char *info)
-{
-	char buf[0x1000];
-	sprintf(buf, "[x_monitor_show] in  %s\n", info);
-	x_node *p = exclusive_monitor_head->next;
-	while (p) {
-		sprintf(buf, "%sthread %d x_addr %x x_page %x\n", buf, p->tid, p->exclusive_addr, p->page_addr);
-		p = p->next;
-	}
-	fprintf(stderr, "%s", buf);
-}
-		
-
-void* x_monitor_register_thread(int tid)
-{
-#ifdef X_LOG
-	fprintf(stderr, "[register_thread]\tregistering thread %d\n", tid);
-#endif
-
-	pthread_mutex_lock(&x_mon_mutex);
-	thread_count++;
-	if (thread_count == 1) {
-		ftime(&t_start);
-		fprintf(stderr, "[x_mon]\tprogram start!\n");
-	}
-	if (thread_count>1)
-	if (!is_multi) {
-		is_multi = 1;
-		ftime(&t_multi_start);
-		int secDiff = t_multi_start.time - t_start.time;
-		secDiff *= 1000;
-		secDiff += (t_multi_start.millitm - t_start.millitm);
-		fprintf(stderr, "[x_mon]\tmulti thread begin! used: %dms\n", secDiff);
-		t_single += secDiff;
-	}
-	x_node *p = malloc(sizeof(x_node));
-	p->tid = tid;
-	p->exclusive_addr = 0;
-	p->page_addr = 0;
-	p->next = exclusive_monitor_head->next;
-	exclusive_monitor_head->next = p;
-#ifdef X_LOG
-	x_monitor_show("register thread");
-#endif
-	pthread_mutex_unlock(&x_mon_mutex);
-	return (void*)p;
-}
-int x_monitor_unregister_thread(int tid)
-{
-	int ret = 1;
-	pthread_mutex_lock(&x_mon_mutex);
-#ifdef X_LOG
-	x_monitor_show("unregister thread");
-#endif
-	thread_count--;
-	if (thread_count == 1) {
-		is_multi = 0;
-		ftime(&t_multi_end);
-		int secDiff = t_multi_end.time - t_multi_start.time;
-		secDiff *= 1000;
-		secDiff += (t_multi_end.millitm - t_multi_start.millitm);
-		fprintf(stderr, "[x_mon]\tmulti thread end! used: %dms\n", secDiff);
-		t_multi += secDiff;
-	}
-	if (thread_count == 0) {
-		is_multi = 0;
-		ftime(&t_end);
-		int secDiff = t_end.time - t_multi_end.time;
-		secDiff *= 1000;
-		secDiff += (t_end.millitm - t_multi_end.millitm);
-		t_single += secDiff;
-		fprintf(stderr, "[x_mon]\tall thread end! used: %dms\n", secDiff);
-		double total = (double)t_single+(double)t_multi;
-		fprintf(stderr, "[x_mon]\tt_single=%lldms, t_multi=%lldms, single rate=%lf\n", 
-				t_single, t_multi, (double)t_single/total);
-		fprintf(stderr, "[x_mon]\tllsc_single=%lld, llsc_multi=%lld\n", llsc_single, llsc_multi);
-	}
-
-
-	x_node *p = exclusive_monitor_head->next, *pre = exclusive_monitor_head;
-	while (p) {
-		if (p->tid == tid) {
-			ret = 0;
-			pre->next = p->next;
-#ifdef X_LOG
-			fprintf(stderr, "unregister thread %d\n", p->tid);
-#endif
-			free(p);
-			break;
-		}
-		pre = p;
-		p = p->next;
-	}
-#ifdef X_LOG
-	x_monitor_show("unregister thread");
-#endif
-	pthread_mutex_unlock(&x_mon_mutex);
-	return ret;
-}
-int x_monitor_set_exclusive_addr(void* p_node, uint32_t addr)
-{
-	pthread_mutex_lock(&x_mon_mutex);
-#ifdef X_LOG
-	fprintf(stderr, "[x_monitor_set_exclusive_addr]\tp_node %p, addr %x\n", p_node, addr);
-#endif
-	x_node *p = (x_node*)p_node;
-	p->exclusive_addr = addr;
-	p->page_addr = addr & PAGE_MASK;
-#ifdef X_LOG
-	x_monitor_show("set x addr");
-#endif
-	pthread_mutex_unlock(&x_mon_mutex);
-	return 0;
-}
-int x_monitor_check_exclusive(void* p_node, uint32_t addr)
-{
-	x_node *p = (x_node*)p_node;
-    int ret = (int)(p->exclusive_addr == addr);
-    p->exclusive_addr = 0;
-	return ret;
-}
-
-int x_monitor_check_and_clean(int tid, uint32_t addr)
-{
-	pthread_mutex_lock(&x_mon_mutex);
-	x_node *p = exclusive_monitor_head->next;
-	uint32_t page_addr = addr & PAGE_MASK;
-	while (p) {
-		if (p->page_addr == page_addr) {
-			//!!!!!!!!!!!!!
-				p->exclusive_addr = 0;
-#ifdef X_LOG
-				fprintf(stderr, "cleaned thread %d x_addr %x\n", p->tid, p->exclusive_addr);
-#endif
-		}
-		p = p->next;
-	}
-#ifdef X_LOG
-	x_monitor_show("check and clean");
-#endif
-	pthread_mutex_unlock(&x_mon_mutex);
-	return 0;
-}
-
-
-
-
-
-#endif
 
 char *exec_path;
 
@@ -302,16 +125,23 @@ int cpu_get_pic_interrupt(CPUX86State *env)
 /* Helper routines for implementing atomic operations.  */
 
 /* Make sure everything is in a consistent state for calling fork().  */
-void fork_start(void)
+bool fork_start(void)
 {
     start_exclusive();
-    mmap_fork_start();
+    x_monitor_fork_start();
+    if (!mmap_fork_start()) {
+        x_monitor_fork_end(0);
+        end_exclusive();
+        return false;
+    }
     cpu_list_lock();
+    return true;
 }
 
 void fork_end(int child)
 {
     mmap_fork_end(child);
+    x_monitor_fork_end(child);
     if (child) {
         CPUState *cpu, *next_cpu;
         /* Child processes created by fork() only have a single thread.
@@ -553,6 +383,102 @@ static void handle_arg_reserved_va(const char *arg)
     }
 }
 
+static void handle_arg_shadow_mem(const char *arg)
+{
+    guest_shadow_eager = true;
+}
+
+static void handle_arg_llsc(const char *arg)
+{
+    LLSCScheme scheme;
+
+    if (!strcmp(arg, "cmpxchg")) {
+        scheme = LLSC_CMPXCHG;
+    } else if (!strcmp(arg, "hst")) {
+        scheme = LLSC_HST;
+    } else if (!strcmp(arg, "pst")) {
+        scheme = LLSC_PST;
+    } else if (!strcmp(arg, "excp")) {
+        scheme = LLSC_EXCP;
+    } else if (!strcmp(arg, "hybrid")) {
+        scheme = LLSC_HYBRID;
+    } else {
+        fprintf(stderr, "Unknown LL/SC scheme '%s' "
+                "(cmpxchg, hst, pst, excp, hybrid)\n", arg);
+        exit(EXIT_FAILURE);
+    }
+    if (!(LLSC_TARGET_SCHEMES & (1 << scheme))) {
+        fprintf(stderr, "LL/SC scheme '%s' is not supported for %s\n",
+                arg, TARGET_NAME);
+        exit(EXIT_FAILURE);
+    }
+    llsc_scheme = scheme;
+}
+
+static void handle_arg_llsc_rtm(const char *arg)
+{
+    if (!strcmp(arg, "auto")) {
+        llsc_rtm_mode = LLSC_RTM_AUTO;
+    } else if (!strcmp(arg, "off")) {
+        llsc_rtm_mode = LLSC_RTM_OFF;
+    } else if (!strcmp(arg, "abort")) {
+        llsc_rtm_mode = LLSC_RTM_ABORT;
+    } else {
+        fprintf(stderr, "Unknown LL/SC RTM mode '%s' (auto, off, abort)\n",
+                arg);
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void handle_arg_llsc_wp(const char *arg)
+{
+    if (!strcmp(arg, "mprotect")) {
+        llsc_wp_backend = LLSC_WP_MPROTECT;
+    } else if (!strcmp(arg, "uffd")) {
+        llsc_wp_backend = LLSC_WP_UFFD;
+    } else {
+        fprintf(stderr, "Unknown LL/SC write protection '%s' "
+                "(mprotect, uffd)\n", arg);
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void handle_arg_llsc_hash(const char *arg)
+{
+    if (!strcmp(arg, "word")) {
+        llsc_hash_fn = LLSC_HASH_WORD;
+    } else if (!strcmp(arg, "mul")) {
+        llsc_hash_fn = LLSC_HASH_MUL;
+    } else {
+        fprintf(stderr, "Unknown LL/SC hash function '%s' (word, mul)\n",
+                arg);
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void handle_arg_llsc_hash_size(const char *arg)
+{
+    uint64_t size;
+
+    if (qemu_strtosz(arg, NULL, &size) < 0 || !is_power_of_2(size) ||
+        size < 4 * KiB || size > 1 * GiB) {
+        fprintf(stderr, "LL/SC hash table size must be a power of two "
+                "between 4k and 1G\n");
+        exit(EXIT_FAILURE);
+    }
+    llsc_hash_bits = ctz64(size) - 2;
+}
+
+static void handle_arg_llsc_stats(const char *arg)
+{
+    llsc_stats_path = arg;
+}
+
+static void handle_arg_llsc_profile(const char *arg)
+{
+    llsc_profile_path = arg;
+}
+
 static void handle_arg_singlestep(const char *arg)
 {
     singlestep = 1;
@@ -611,6 +537,22 @@ static const struct qemu_argument arg_table[] = {
      "address",    "set guest_base address to 'address'"},
     {"R",          "QEMU_RESERVED_VA", true,  handle_arg_reserved_va,
      "size",       "reserve 'size' bytes for guest virtual address space"},
+    {"shadow-mem", "QEMU_SHADOW_MEM",  false, handle_arg_shadow_mem,
+     "",           "back private guest memory with the writable shadow view"},
+    {"llsc",       "QEMU_LLSC",        true,  handle_arg_llsc,
+     "scheme",     "LL/SC emulation scheme (cmpxchg, hst, pst, excp, hybrid)"},
+    {"llsc-rtm",   "QEMU_LLSC_RTM",    true,  handle_arg_llsc_rtm,
+     "mode",       "TSX store-conditional (auto, off, abort)"},
+    {"llsc-wp",    "QEMU_LLSC_WP",     true,  handle_arg_llsc_wp,
+     "backend",    "PST page write protection (mprotect, uffd)"},
+    {"llsc-hash",  "QEMU_LLSC_HASH",   true,  handle_arg_llsc_hash,
+     "fn",         "hash function of the hst table (word, mul)"},
+    {"llsc-hash-size", "QEMU_LLSC_HASH_SIZE", true, handle_arg_llsc_hash_size,
+     "size",       "size in bytes of the hst table (default 16M)"},
+    {"llsc-stats", "QEMU_LLSC_STATS",  true,  handle_arg_llsc_stats,
+     "file",       "write LL/SC statistics as JSON to 'file' ('-' for stderr)"},
+    {"llsc-profile", "QEMU_LLSC_PROFILE", true, handle_arg_llsc_profile,
+     "file",       "write the per-PC LL/SC profile to 'file' ('-' for stderr)"},
     {"d",          "QEMU_LOG",         true,  handle_arg_log,
      "item[,...]", "enable logging of specified items "
      "(use '-d help' for a list of items)"},
@@ -792,13 +734,13 @@ int main(int argc, char **argv, char **envp)
     int ret;
     int execfd;
 
-	ftime(&t_start);
     error_init(argv[0]);
     module_call_init(MODULE_INIT_TRACE);
     qemu_init_cpu_list();
     module_call_init(MODULE_INIT_QOM);
 
-	pthread_mutex_init(&g_sc_lock, NULL);
+    pthread_mutex_init(&g_sc_lock, NULL);
+    x_monitor_init();
 
     envlist = envlist_create();
 
@@ -971,7 +913,6 @@ int main(int argc, char **argv, char **envp)
     cpu->opaque = ts;
     task_settid(ts);
 	assert(tid != 0);
-	env->exclusive_tid = tid;
 
     ret = loader_exec(execfd, filename, target_argv, target_environ, regs,
         info, &bprm);
@@ -1008,6 +949,32 @@ int main(int argc, char **argv, char **envp)
     syscall_init();
     signal_init();
 
+    /*
+     * guest_base is fixed now, so the shadow view can be laid out.  Only
+     * PST store-conditionals and -shadow-mem use it.  A 48-bit guest
+     * space is more than the host can map twice, so only its low
+     * GUEST_SHADOW_MAX bytes get one; reserved_va sizes it exactly.
+     */
+    if (llsc_uses_pst() || guest_shadow_eager) {
+        unsigned long shadow_size = reserved_va;
+
+#if HOST_LONG_BITS > TARGET_VIRT_ADDR_SPACE_BITS
+        if (!shadow_size) {
+            shadow_size = MIN(GUEST_ADDR_MAX + 1, GUEST_SHADOW_MAX);
+        }
+#endif
+        if (shadow_size && !guest_shadow_init(shadow_size)) {
+            fprintf(stderr, "qemu: warning: cannot map a 0x%lx byte guest "
+                    "shadow, running without it\n", shadow_size);
+        }
+    }
+
+    if (llsc_scheme == LLSC_HST) {
+        llsc_hash_init();
+    }
+    x_monitor_wp_init();
+    llsc_profile_init();
+
     /* Now that we've loaded the binary, GUEST_BASE is fixed.  Delay
        generating the prologue until now so that the prologue can take
        the real value of GUEST_BASE into account.  */
@@ -1024,11 +991,8 @@ int main(int argc, char **argv, char **envp)
         }
         gdb_handlesig(cpu, 0);
     }
-	uint32_t ret_mmp = target_mmap(0xa0000000, 
-						0x10000000, PROT_READ|PROT_WRITE,
-						MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
-	assert(ret_mmp == 0xa0000000);
-	((CPUARMState*)env)->exclusive_node = (uint64_t)x_monitor_register_thread(tid);
+    ts->x_monitor_node = x_monitor_register_thread(ts->ts_tid);
+    cpu_neg(cpu)->llsc_addr = &ts->x_monitor_node->exclusive_addr;
     cpu_loop(env);
     /* never exits */
     return 0;
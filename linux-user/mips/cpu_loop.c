@@ -21,6 +21,7 @@
 #include "qemu-common.h"
 #include "qemu.h"
 #include "cpu_loop-common.h"
+#include "x-monitor.h"
 #include "elf.h"
 
 # ifdef TARGET_ABI_MIPSO32
@@ -438,6 +439,8 @@ void cpu_loop(CPUMIPSState *env)
         cpu_exec_start(cs);
         trapnr = cpu_exec(cs);
         cpu_exec_end(cs);
+        /* idle PST pages left protected by store-conditionals */
+        x_monitor_pst_flush();
         process_queued_cpu_work(cs);
 
         switch(trapnr) {
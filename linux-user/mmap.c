@@ -17,8 +17,12 @@
  *  along with this program; if not, see <http://www.gnu.org/licenses/>.
  */
 #include "qemu/osdep.h"
+#include "qemu/bitmap.h"
+#include "qemu/memfd.h"
+#include "qemu-common.h"
 
 #include "qemu.h"
+#include "x-monitor.h"
 
 //#define DEBUG_MMAP
 
@@ -44,20 +48,290 @@ bool have_mmap_lock(void)
     return mmap_lock_count > 0 ? true : false;
 }
 
-/* Grab lock to make sure things are in a consistent state after fork().  */
-void mmap_fork_start(void)
+/*
+ * A fork child shares the adopted pages with its parent until
+ * guest_shadow_fork_child() has copied them, so the parent must not run
+ * guest code before then.  The child closes its end of this pipe when
+ * it is done, and the parent waits for the end of file.
+ */
+static int guest_shadow_fork_pipe[2] = { -1, -1 };
+
+/*
+ * Grab lock to make sure things are in a consistent state after fork().
+ * Returns false if the fork cannot be synchronised with the child.
+ */
+bool mmap_fork_start(void)
 {
     if (mmap_lock_count)
         abort();
+    if (guest_shadow_fd >= 0 && qemu_pipe(guest_shadow_fork_pipe) < 0) {
+        return false;
+    }
     pthread_mutex_lock(&mmap_mutex);
+    return true;
 }
 
 void mmap_fork_end(int child)
 {
-    if (child)
+    char c;
+
+    if (child) {
         pthread_mutex_init(&mmap_mutex, NULL);
-    else
+        guest_shadow_fork_child();
+    }
+    if (guest_shadow_fork_pipe[0] >= 0) {
+        close(guest_shadow_fork_pipe[1]);
+        if (!child) {
+            /* Also returns at once if fork() failed.  */
+            while (read(guest_shadow_fork_pipe[0], &c, 1) < 0 &&
+                   errno == EINTR) {
+                continue;
+            }
+        }
+        close(guest_shadow_fork_pipe[0]);
+        guest_shadow_fork_pipe[0] = guest_shadow_fork_pipe[1] = -1;
+    }
+    if (!child) {
         pthread_mutex_unlock(&mmap_mutex);
+    }
+}
+
+/*
+ * Shadow view of guest memory.
+ *
+ * Guest pages can be backed by a memfd that is mapped a second time,
+ * permanently read-write, at guest_shadow_base.  Guest address A lives
+ * at offset A of the memfd, so g2shadow() is a constant offset like
+ * g2h().  Protection changes on the guest view, such as the PST
+ * read-only window over an exclusive page, leave the shadow writable,
+ * so a store-conditional can update the page without touching any
+ * mapping.
+ *
+ * A host page is moved into the memfd ("adopted") the first time it
+ * needs the alias.  With guest_shadow_eager, private mappings created
+ * by target_mmap are instead mapped from the memfd directly and alias
+ * the shadow from the start; a fork child still gets private copies,
+ * so forking then costs a copy of the guest's private memory.
+ * Offsets that no guest page aliases are always holes in the memfd.
+ *
+ * guest_shadow_map records the target pages whose
+ * guest view currently aliases the shadow, and guest_shared_map the
+ * pages of MAP_SHARED mappings, which must keep their own backing and
+ * are never adopted.  Both are only written with mmap_lock held.
+ */
+int guest_shadow_fd = -1;
+unsigned long guest_shadow_base;
+bool guest_shadow_eager;
+static unsigned long guest_shadow_size;
+static unsigned long *guest_shadow_map;
+static unsigned long *guest_shared_map;
+
+bool guest_shadow_init(unsigned long size)
+{
+    void *p;
+    int fd;
+
+    fd = qemu_memfd_create("qemu-guest-shadow", size, false, 0, 0, NULL);
+    if (fd < 0) {
+        return false;
+    }
+    p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+             MAP_SHARED | MAP_NORESERVE, fd, 0);
+    if (p == MAP_FAILED) {
+        close(fd);
+        return false;
+    }
+
+    guest_shadow_fd = fd;
+    guest_shadow_base = (unsigned long)p;
+    guest_shadow_size = size;
+    if (!guest_shadow_map) {
+        guest_shadow_map = bitmap_new(size >> TARGET_PAGE_BITS);
+        guest_shared_map = bitmap_new(size >> TARGET_PAGE_BITS);
+    }
+    return true;
+}
+
+bool guest_shadow_page(abi_ulong addr)
+{
+    return guest_shadow_fd >= 0 && addr < guest_shadow_size &&
+           test_bit(addr >> TARGET_PAGE_BITS, guest_shadow_map);
+}
+
+/*
+ * The guest view of [start, end) is about to be replaced or removed:
+ * it no longer aliases the shadow, and the memfd pages can be freed so
+ * that a later adoption starts from a hole.  Only whole host pages are
+ * passed in, since a fragment keeps the existing host mapping.
+ */
+static void guest_shadow_forget(abi_ulong start, abi_ulong end)
+{
+    if (guest_shadow_fd < 0 || start >= end || start >= guest_shadow_size) {
+        return;
+    }
+    end = MIN(end, guest_shadow_size);
+    if (find_next_bit(guest_shadow_map, end >> TARGET_PAGE_BITS,
+                      start >> TARGET_PAGE_BITS) >= end >> TARGET_PAGE_BITS) {
+        return;
+    }
+    bitmap_clear(guest_shadow_map, start >> TARGET_PAGE_BITS,
+                 (end - start) >> TARGET_PAGE_BITS);
+    fallocate(guest_shadow_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+              start, end - start);
+}
+
+static bool guest_shared_page(abi_ulong addr)
+{
+    return guest_shadow_fd >= 0 && addr < guest_shadow_size &&
+           test_bit(addr >> TARGET_PAGE_BITS, guest_shared_map);
+}
+
+void guest_shadow_set_shared(abi_ulong start, abi_ulong end, bool shared)
+{
+    if (guest_shadow_fd < 0 || start >= guest_shadow_size) {
+        return;
+    }
+    end = MIN((unsigned long)TARGET_PAGE_ALIGN(end), guest_shadow_size);
+    if (shared) {
+        bitmap_set(guest_shared_map, start >> TARGET_PAGE_BITS,
+                   (end - start) >> TARGET_PAGE_BITS);
+    } else {
+        bitmap_clear(guest_shared_map, start >> TARGET_PAGE_BITS,
+                     (end - start) >> TARGET_PAGE_BITS);
+    }
+}
+
+/*
+ * Turn the adopted host pages of [start, end) back into private
+ * anonymous memory with the same contents and protection.  Used when
+ * the pages are about to move away from their memfd offset, and in a
+ * fork child, which must not keep sharing them with its parent.
+ */
+static void guest_shadow_release(abi_ulong start, abi_ulong end)
+{
+    abi_ulong addr, a;
+
+    for (addr = start & qemu_host_page_mask; addr < end;
+         addr += qemu_host_page_size) {
+        int prot = 0;
+        void *p;
+
+        if (!guest_shadow_page(addr)) {
+            continue;
+        }
+        for (a = addr; a < addr + qemu_host_page_size; a += TARGET_PAGE_SIZE) {
+            prot |= page_get_flags(a);
+        }
+        p = mmap(NULL, qemu_host_page_size, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        assert(p != MAP_FAILED);
+        memcpy(p, g2shadow(addr), qemu_host_page_size);
+        mprotect(p, qemu_host_page_size, prot & PAGE_BITS);
+        p = mremap(p, qemu_host_page_size, qemu_host_page_size,
+                   MREMAP_FIXED | MREMAP_MAYMOVE, g2h(addr));
+        assert(p == g2h(addr));
+        guest_shadow_forget(addr, addr + qemu_host_page_size);
+    }
+}
+
+/*
+ * Move the host page containing ADDR into the shadow memfd, so that the
+ * guest view and the shadow alias the same memory.  The caller must
+ * exclude every writer of the page by having made it read-only on the
+ * host, and the guest view stays read-only.  Returns true if the page
+ * aliases the shadow on return.
+ */
+bool guest_shadow_adopt(abi_ulong addr)
+{
+    abi_ulong start = addr & qemu_host_page_mask;
+    abi_ulong a;
+    bool ret = false;
+    int prot = 0;
+    void *p;
+
+    if (guest_shadow_fd < 0 ||
+        (unsigned long)start + qemu_host_page_size > guest_shadow_size) {
+        return false;
+    }
+    if (guest_shadow_page(start)) {
+        return true;
+    }
+
+    mmap_lock();
+    if (guest_shadow_page(start)) {
+        ret = true;
+        goto out;
+    }
+    for (a = start; a - start < qemu_host_page_size; a += TARGET_PAGE_SIZE) {
+        if (guest_shared_page(a)) {
+            goto out;
+        }
+        prot |= page_get_flags(a);
+    }
+    if (!(prot & PAGE_VALID) || !(prot & PAGE_READ)) {
+        goto out;
+    }
+
+    memcpy(g2shadow(start), g2h(start), qemu_host_page_size);
+    p = mmap(g2h(start), qemu_host_page_size, prot & PAGE_BITS & ~PAGE_WRITE,
+             MAP_SHARED | MAP_FIXED, guest_shadow_fd, start);
+    if (p == MAP_FAILED) {
+        goto out;
+    }
+    bitmap_set(guest_shadow_map, start >> TARGET_PAGE_BITS,
+               qemu_host_page_size >> TARGET_PAGE_BITS);
+    ret = true;
+out:
+    mmap_unlock();
+    return ret;
+}
+
+/*
+ * Map [start, start + len) of the guest view straight from the memfd
+ * when guest_shadow_eager is set.  The range reads as zeroes.  Returns
+ * false if the caller must create the mapping itself.
+ */
+static bool guest_shadow_map_fixed(abi_ulong start, abi_ulong len, int prot)
+{
+    void *p;
+
+    if (!guest_shadow_eager || guest_shadow_fd < 0 ||
+        (unsigned long)start + len > guest_shadow_size) {
+        return false;
+    }
+    guest_shadow_forget(start, start + len);
+    p = mmap(g2h(start), len, prot, MAP_SHARED | MAP_FIXED,
+             guest_shadow_fd, start);
+    if (p == MAP_FAILED) {
+        return false;
+    }
+    bitmap_set(guest_shadow_map, start >> TARGET_PAGE_BITS,
+               len >> TARGET_PAGE_BITS);
+    return true;
+}
+
+/* Called in a fork child: give it a private copy and a fresh memfd.  */
+void guest_shadow_fork_child(void)
+{
+    unsigned long size = guest_shadow_size;
+    unsigned long nr = size >> TARGET_PAGE_BITS;
+    unsigned long page;
+
+    if (guest_shadow_fd < 0) {
+        return;
+    }
+    for (page = find_next_bit(guest_shadow_map, nr, 0); page < nr;
+         page = find_next_bit(guest_shadow_map, nr, page + 1)) {
+        guest_shadow_release(page << TARGET_PAGE_BITS,
+                             (page << TARGET_PAGE_BITS) + TARGET_PAGE_SIZE);
+    }
+
+    munmap((void *)guest_shadow_base, size);
+    close(guest_shadow_fd);
+    guest_shadow_fd = -1;
+    if (!guest_shadow_init(size)) {
+        guest_shadow_base = 0;
+    }
 }
 
 /* NOTE: all the constants are the HOST ones, but addresses are target. */
@@ -86,6 +360,7 @@ int target_mprotect(abi_ulong start, abi_ulong len, int prot)
         return 0;
 
     mmap_lock();
+    x_monitor_pst_forget(start, end);
     host_start = start & qemu_host_page_mask;
     host_end = HOST_PAGE_ALIGN(end);
     if (start > host_start) {
@@ -152,10 +427,13 @@ static int mmap_frag(abi_ulong real_start,
 
     if (prot1 == 0) {
         /* no page was there, so we allocate one */
-        void *p = mmap(host_start, qemu_host_page_size, prot,
-                       flags | MAP_ANONYMOUS, -1, 0);
-        if (p == MAP_FAILED)
-            return -1;
+        if ((flags & MAP_TYPE) != MAP_PRIVATE ||
+            !guest_shadow_map_fixed(real_start, qemu_host_page_size, prot)) {
+            void *p = mmap(host_start, qemu_host_page_size, prot,
+                           flags | MAP_ANONYMOUS, -1, 0);
+            if (p == MAP_FAILED)
+                return -1;
+        }
         prot1 = prot;
     }
     prot1 &= PAGE_BITS;
@@ -463,23 +741,38 @@ abi_long target_mmap(abi_ulong start, abi_ulong len, int prot,
         host_len = len + offset - host_offset;
         host_len = HOST_PAGE_ALIGN(host_len);
 
-        /* Note: we prefer to control the mapping address. It is
-           especially important if qemu_host_page_size >
-           qemu_real_host_page_size */
-        p = mmap(g2h(start), host_len, prot,
-                 flags | MAP_FIXED | MAP_ANONYMOUS, -1, 0);
-        if (p == MAP_FAILED)
-            goto fail;
-        /* update start so that it points to the file position at 'offset' */
-        host_start = (unsigned long)p;
-        if (!(flags & MAP_ANONYMOUS)) {
-            p = mmap(g2h(start), len, prot,
-                     flags | MAP_FIXED, fd, host_offset);
-            if (p == MAP_FAILED) {
-                munmap(g2h(start), host_len);
+        if ((flags & MAP_TYPE) == MAP_PRIVATE &&
+            guest_shadow_map_fixed(start, host_len, prot)) {
+            /* private file data is copied in through the shadow */
+            host_start = (unsigned long)g2h(start);
+            if (!(flags & MAP_ANONYMOUS)) {
+                if (pread(fd, g2shadow(start), len, host_offset) == -1) {
+                    guest_shadow_forget(start, start + host_len);
+                    munmap(g2h(start), host_len);
+                    goto fail;
+                }
+                host_start += offset - host_offset;
+            }
+        } else {
+            /* Note: we prefer to control the mapping address. It is
+               especially important if qemu_host_page_size >
+               qemu_real_host_page_size */
+            p = mmap(g2h(start), host_len, prot,
+                     flags | MAP_FIXED | MAP_ANONYMOUS, -1, 0);
+            if (p == MAP_FAILED)
                 goto fail;
+            /* update start so that it points to the file position at
+               'offset' */
+            host_start = (unsigned long)p;
+            if (!(flags & MAP_ANONYMOUS)) {
+                p = mmap(g2h(start), len, prot,
+                         flags | MAP_FIXED, fd, host_offset);
+                if (p == MAP_FAILED) {
+                    munmap(g2h(start), host_len);
+                    goto fail;
+                }
+                host_start += offset - host_offset;
             }
-            host_start += offset - host_offset;
         }
         start = h2g(host_start);
     } else {
@@ -499,6 +792,7 @@ abi_long target_mmap(abi_ulong start, abi_ulong len, int prot,
             errno = ENOMEM;
             goto fail;
         }
+        x_monitor_pst_forget(start, end);
 
         /* worst case: we cannot map the file because the offset is not
            aligned, so we read it */
@@ -556,18 +850,31 @@ abi_long target_mmap(abi_ulong start, abi_ulong len, int prot,
         if (real_start < real_end) {
             void *p;
             unsigned long offset1;
+            guest_shadow_forget(real_start, real_end);
             if (flags & MAP_ANONYMOUS)
                 offset1 = 0;
             else
                 offset1 = offset + real_start - start;
-            p = mmap(g2h(real_start), real_end - real_start,
-                     prot, flags, fd, offset1);
-            if (p == MAP_FAILED)
-                goto fail;
+            if ((flags & MAP_TYPE) == MAP_PRIVATE &&
+                guest_shadow_map_fixed(real_start, real_end - real_start,
+                                       prot)) {
+                if (!(flags & MAP_ANONYMOUS) &&
+                    pread(fd, g2shadow(real_start), real_end - real_start,
+                          offset1) == -1) {
+                    goto fail;
+                }
+            } else {
+                p = mmap(g2h(real_start), real_end - real_start,
+                         prot, flags, fd, offset1);
+                if (p == MAP_FAILED)
+                    goto fail;
+            }
         }
     }
  the_end1:
     page_set_flags(start, start + len, prot | PAGE_VALID);
+    guest_shadow_set_shared(start, start + len,
+                            (flags & MAP_TYPE) == MAP_SHARED);
  the_end:
 #ifdef DEBUG_MMAP
     printf("ret=0x" TARGET_ABI_FMT_lx "\n", start);
@@ -642,6 +949,7 @@ int target_munmap(abi_ulong start, abi_ulong len)
 
     mmap_lock();
     end = start + len;
+    x_monitor_pst_forget(start, end);
     real_start = start & qemu_host_page_mask;
     real_end = HOST_PAGE_ALIGN(end);
 
@@ -672,6 +980,7 @@ int target_munmap(abi_ulong start, abi_ulong len)
     ret = 0;
     /* unmap what we can */
     if (real_start < real_end) {
+        guest_shadow_forget(real_start, real_end);
         if (reserved_va) {
             mmap_reserve(real_start, real_end - real_start);
         } else {
@@ -681,6 +990,7 @@ int target_munmap(abi_ulong start, abi_ulong len)
 
     if (ret == 0) {
         page_set_flags(start, start + len, 0);
+        guest_shadow_set_shared(start, start + len, false);
         tb_invalidate_phys_range(start, start + len);
     }
     mmap_unlock();
@@ -692,6 +1002,7 @@ abi_long target_mremap(abi_ulong old_addr, abi_ulong old_size,
                        abi_ulong new_addr)
 {
     int prot;
+    bool shared;
     void *host_addr;
 
     if (!guest_range_valid(old_addr, old_size) ||
@@ -703,6 +1014,14 @@ abi_long target_mremap(abi_ulong old_addr, abi_ulong old_size,
 
     mmap_lock();
 
+    x_monitor_pst_forget(old_addr, old_addr + old_size);
+    if (flags & MREMAP_FIXED) {
+        x_monitor_pst_forget(new_addr, new_addr + new_size);
+    }
+    /* the pages leave their memfd offset, so they cannot stay adopted */
+    guest_shadow_release(old_addr, old_addr + old_size);
+    shared = guest_shared_page(old_addr);
+
     if (flags & MREMAP_FIXED) {
         host_addr = mremap(g2h(old_addr), old_size, new_size,
                            flags, g2h(new_addr));
@@ -762,6 +1081,9 @@ abi_long target_mremap(abi_ulong old_addr, abi_ulong old_size,
         prot = page_get_flags(old_addr);
         page_set_flags(old_addr, old_addr + old_size, 0);
         page_set_flags(new_addr, new_addr + new_size, prot | PAGE_VALID);
+        guest_shadow_set_shared(old_addr, old_addr + old_size, false);
+        guest_shadow_forget(new_addr, new_addr + new_size);
+        guest_shadow_set_shared(new_addr, new_addr + new_size, shared);
     }
     tb_invalidate_phys_range(new_addr, new_addr + new_size);
     mmap_unlock();
@@ -21,6 +21,7 @@
 #include "qemu-common.h"
 #include "qemu.h"
 #include "cpu_loop-common.h"
+#include "x-monitor.h"
 
 static inline uint64_t cpu_ppc_get_tb(CPUPPCState *env)
 {
@@ -79,6 +80,8 @@ void cpu_loop(CPUPPCState *env)
         cpu_exec_start(cs);
         trapnr = cpu_exec(cs);
         cpu_exec_end(cs);
+        /* idle PST pages left protected by store-conditionals */
+        x_monitor_pst_flush();
         process_queued_cpu_work(cs);
 
         arch_interrupt = true;
@@ -153,6 +153,9 @@ typedef struct TaskState {
 
     /* This thread's sigaltstack, if it has one */
     struct target_sigaltstack sigaltstack_used;
+
+    /* This thread's LL/SC reservation, see x-monitor.h */
+    struct XMonitorNode *x_monitor_node;
 } __attribute__((aligned(16))) TaskState;
 
 extern char *exec_path;
@@ -217,7 +220,7 @@ void cpu_loop(CPUArchState *env);
 const char *target_strerror(int err);
 int get_osversion(void);
 void init_qemu_uname_release(void);
-void fork_start(void);
+bool fork_start(void);
 void fork_end(int child);
 
 /* Creates the initial guest address space in the host memory space using
@@ -445,8 +448,24 @@ abi_long target_mremap(abi_ulong old_addr, abi_ulong old_size,
 extern unsigned long last_brk;
 extern abi_ulong mmap_next_start;
 abi_ulong mmap_find_vma(abi_ulong, abi_ulong, abi_ulong);
-void mmap_fork_start(void);
+bool mmap_fork_start(void);
 void mmap_fork_end(int child);
+/*
+ * Most guest addresses a shadow can cover without reserved_va; 64-bit
+ * guests map above TASK_UNMAPPED_BASE, 1 << 38.
+ */
+#define GUEST_SHADOW_MAX (1ul << 40)
+extern int guest_shadow_fd;
+extern unsigned long guest_shadow_base;
+extern bool guest_shadow_eager;
+bool guest_shadow_init(unsigned long size);
+bool guest_shadow_page(abi_ulong addr);
+bool guest_shadow_adopt(abi_ulong addr);
+void guest_shadow_set_shared(abi_ulong start, abi_ulong end, bool shared);
+void guest_shadow_fork_child(void);
+
+/* Writable alias of a guest address whose page aliases the shadow.  */
+#define g2shadow(x) ((void *)(guest_shadow_base + (abi_ptr)(x)))
 
 /* main.c */
 extern unsigned long guest_stack_size;
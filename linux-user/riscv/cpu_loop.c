@@ -22,6 +22,7 @@
 #include "qemu/error-report.h"
 #include "qemu.h"
 #include "cpu_loop-common.h"
+#include "x-monitor.h"
 #include "elf.h"
 
 void cpu_loop(CPURISCVState *env)
@@ -35,6 +36,8 @@ void cpu_loop(CPURISCVState *env)
         cpu_exec_start(cs);
         trapnr = cpu_exec(cs);
         cpu_exec_end(cs);
+        /* idle PST pages left protected by store-conditionals */
+        x_monitor_pst_flush();
         process_queued_cpu_work(cs);
 
         signum = 0;
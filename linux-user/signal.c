@@ -18,15 +18,16 @@
  */
 #include "qemu/osdep.h"
 #include "qemu/bitops.h"
+#include "qemu/timer.h"
 #include <sys/ucontext.h>
 #include <sys/resource.h>
 
 #include "qemu.h"
 #include "trace.h"
 #include "signal-common.h"
+#include "x-monitor.h"
+#include "llsc-profile.h"
 
-#define PF_LLSC
-//#define PF_LOG
 static struct target_sigaction sigact_table[TARGET_NSIG];
 
 static void host_signal_handler(int host_signum, siginfo_t *info,
@@ -650,33 +651,227 @@ static inline void rewind_if_in_safe_syscall(void *puc)
 }
 #endif
 
-#ifdef PF_LLSC
-extern void cpu_exec_step_atomic_pf(CPUState *cpu);
-extern int x_monitor_check_and_clean(int tid, uint32_t addr);
-extern pthread_mutex_t g_sc_lock;
-static int pf_llsc_segfault_handler(int host_signum, siginfo_t *pinfo, void *puc)
+#if defined(__x86_64__)
+/*
+ * Decode the host store that faulted at HOST_ADDR into ST, so that the
+ * PST monitor can do it itself.  Only the MOV and MOVBE forms that TCG
+ * and compiled code use for plain stores are known: register or
+ * immediate source, ModRM memory operand, optional GS (guest_base) and
+ * address-size prefixes.  Returns the instruction length, or 0 for
+ * anything else.
+ */
+static int pf_llsc_decode_store(ucontext_t *uc, unsigned long host_addr,
+                                XMonitorStore *st)
 {
-    siginfo_t *info = pinfo;
-    ucontext_t *uc = (ucontext_t *)puc;
-    unsigned long host_addr = (unsigned long)info->si_addr;
-    unsigned long  guest_addr = h2g(host_addr);
-	target_ulong page_addr = guest_addr & 0xfffff000;
-    int is_write = ((uc->uc_mcontext.gregs[REG_ERR] & 0x2) != 0);
-	
-	//write permission is not more always true
-    CPUArchState *env = thread_cpu->env_ptr;
-    CPUState *cpu = env_cpu(env);
-    fprintf(stderr, "[pf_llsc_segfault_handler]\tthread %d tguest addr is %p, host_addr is %p, perm %d, guest pc %x\n", ((CPUARMState *)env)->exclusive_tid, (void *)guest_addr, (void *)host_addr, is_write + 1, ((CPUARMState *)env)->regs[15]);
+    static const int gregs[16] = {
+        REG_RAX, REG_RCX, REG_RDX, REG_RBX, REG_RSP, REG_RBP, REG_RSI, REG_RDI,
+        REG_R8, REG_R9, REG_R10, REG_R11, REG_R12, REG_R13, REG_R14, REG_R15,
+    };
+    greg_t *r = uc->uc_mcontext.gregs;
+    const uint8_t *pc = (const uint8_t *)r[REG_RIP];
+    const uint8_t *p = pc;
+    bool opsize = false, addr32 = false, gs = false, imm = false;
+    bool movbe = false, riprel = false;
+    int rex = 0, modrm, mod, rm, reg, size;
+    uint64_t ea = 0, val;
+
+    for (;; p++) {
+        if (*p == 0x66) {
+            opsize = true;
+        } else if (*p == 0x67) {
+            addr32 = true;
+        } else if (*p == 0x65) {
+            gs = true;
+        } else {
+            break;
+        }
+    }
+    if ((*p & 0xf0) == 0x40) {
+        rex = *p++;
+    }
+    size = rex & 8 ? 8 : opsize ? 2 : 4;
+    switch (*p++) {
+    case 0x88:
+        size = 1;
+        break;
+    case 0x89:
+        break;
+    case 0xc6:
+        size = 1;
+        imm = true;
+        break;
+    case 0xc7:
+        imm = true;
+        break;
+    case 0x0f:
+        if (p[0] != 0x38 || p[1] != 0xf1) {
+            return 0;
+        }
+        p += 2;
+        movbe = true;
+        break;
+    default:
+        return 0;
+    }
+
+    modrm = *p++;
+    mod = modrm >> 6;
+    reg = ((modrm >> 3) & 7) | ((rex & 4) << 1);
+    rm = modrm & 7;
+    if (mod == 3 || (imm && (reg & 7))) {
+        return 0;
+    }
+    if (rm == 4) {
+        int sib = *p++;
+        int index = ((sib >> 3) & 7) | ((rex & 2) << 2);
+        int base = (sib & 7) | ((rex & 1) << 3);
+
+        if (index != 4) {
+            ea = r[gregs[index]] << (sib >> 6);
+        }
+        if (mod == 0 && (base & 7) == 5) {
+            ea += (int32_t)ldl_le_p(p);
+            p += 4;
+        } else {
+            ea += r[gregs[base]];
+        }
+    } else if (mod == 0 && rm == 5) {
+        riprel = true;
+        ea = (int32_t)ldl_le_p(p);
+        p += 4;
+    } else {
+        ea = r[gregs[rm | ((rex & 1) << 3)]];
+    }
+    if (mod == 1) {
+        ea += (int8_t)*p++;
+    } else if (mod == 2) {
+        ea += (int32_t)ldl_le_p(p);
+        p += 4;
+    }
+
+    if (imm) {
+        if (size == 1) {
+            val = *p++;
+        } else if (size == 2) {
+            val = lduw_le_p(p);
+            p += 2;
+        } else {
+            val = (int64_t)(int32_t)ldl_le_p(p);
+            p += 4;
+        }
+    } else if (size == 1 && !rex && reg >= 4) {
+        /* %ah, %ch, %dh, %bh */
+        val = r[gregs[reg - 4]] >> 8;
+    } else {
+        val = r[gregs[reg]];
+    }
+    if (movbe) {
+        val = size == 2 ? bswap16(val) : size == 4 ? bswap32(val)
+                                                   : bswap64(val);
+    }
+
+    if (riprel) {
+        ea += (uintptr_t)p;
+    }
+    if (addr32) {
+        ea = (uint32_t)ea;
+    }
+    if (gs) {
+        ea += guest_base;
+    }
+    /* The fault must be inside the store, which must be guest memory.  */
+    if (host_addr < ea || host_addr >= ea + size || !h2g_valid(ea)) {
+        return 0;
+    }
 
-    // wait for the doing sc done and unprotect the page
-	pthread_mutex_lock(&g_sc_lock);
-    x_monitor_check_and_clean(((CPUARMState *)cpu)->exclusive_tid, guest_addr);
-    target_mprotect(page_addr, 0x1000, PROT_READ | PROT_WRITE);
-    pthread_mutex_unlock(&g_sc_lock);
+    st->addr = h2g(ea);
+    st->val = val;
+    st->size = size;
+    return p - pc;
+}
+
+static uintptr_t pf_llsc_host_pc(ucontext_t *uc)
+{
+    return uc->uc_mcontext.gregs[REG_RIP];
+}
+
+static bool pf_llsc_is_write(ucontext_t *uc)
+{
+    return (uc->uc_mcontext.gregs[REG_ERR] & 0x2) != 0;
+}
+
+static void pf_llsc_skip(ucontext_t *uc, int len)
+{
+    uc->uc_mcontext.gregs[REG_RIP] += len;
+}
+#else
+/*
+ * No store decoder for this host: faults on protected pages are only
+ * ever resolved by unprotecting the page and retrying the store.
+ */
+static int pf_llsc_decode_store(ucontext_t *uc, unsigned long host_addr,
+                                XMonitorStore *st)
+{
+    return 0;
+}
+
+/* Charged to "other" by the profile.  */
+static uintptr_t pf_llsc_host_pc(ucontext_t *uc)
+{
     return 0;
 }
+
+/* Protected pages stay readable, so a fault on one can only be a write.  */
+static bool pf_llsc_is_write(ucontext_t *uc)
+{
+    return true;
+}
+
+static void pf_llsc_skip(ucontext_t *uc, int len)
+{
+    g_assert_not_reached();
+}
 #endif
 
+/*
+ * Resolve a SIGSEGV taken on a page the PST monitor write-protected.
+ * Returns false if the fault is not the monitor's, in which case it goes
+ * on to cpu_signal_handler like any other.  Runs in signal context, so
+ * all the work is left to x_monitor_pst_fault, which takes no mutex.
+ */
+static bool pf_llsc_segfault_handler(siginfo_t *info, ucontext_t *uc)
+{
+    unsigned long host_addr = (unsigned long)info->si_addr;
+    uintptr_t pc = pf_llsc_host_pc(uc);
+    bool is_write = pf_llsc_is_write(uc);
+    int64_t start = llsc_profile_enabled() ? get_clock() : 0;
+    TaskState *ts = thread_cpu->opaque;
+    XMonitorStore st;
+    int len = 0;
+
+    if (info->si_code <= 0 || !h2g_valid(host_addr)) {
+        return false;
+    }
+    if (is_write) {
+        len = pf_llsc_decode_store(uc, host_addr, &st);
+    }
+    switch (x_monitor_pst_fault(h2g(host_addr), is_write, len ? &st : NULL)) {
+    case XMON_FAULT_FOREIGN:
+        return false;
+    case XMON_FAULT_EMULATED:
+        pf_llsc_skip(uc, len);
+        break;
+    case XMON_FAULT_RETRY:
+        break;
+    }
+
+    trace_user_llsc_pst_fault(ts->ts_tid, h2g(host_addr), (void *)host_addr,
+                              is_write);
+    if (llsc_profile_enabled()) {
+        llsc_profile_fault(pc, get_clock() - start);
+    }
+    return true;
+}
 
 static void host_signal_handler(int host_signum, siginfo_t *info,
                                 void *puc)
@@ -690,14 +885,11 @@ static void host_signal_handler(int host_signum, siginfo_t *info,
     ucontext_t *uc = puc;
     struct emulated_sigtable *k;
 
-#ifdef PF_LLSC
-	// dispatch the segfault to PST pagefault handler
-	if ((host_signum == SIGSEGV) )//&& (info->si_code == SEGV_ACCERR))
-	{
-		pf_llsc_segfault_handler(host_signum, info, puc);
-		return;
-	}
-#endif
+    /* faults on pages write-protected by the PST monitor */
+    if (host_signum == SIGSEGV && llsc_uses_pst() &&
+        pf_llsc_segfault_handler(info, uc)) {
+        return;
+    }
 
     /* the CPU emulator uses some host signals to detect exceptions,
        we forward to it some signals */
@@ -949,6 +1141,14 @@ static void handle_pending_signal(CPUArchState *cpu_env, int sig,
                 save_v86_state(env);
         }
 #endif
+        /*
+         * Exception entry clears the exclusive monitor, so an LL/SC
+         * sequence interrupted by a signal fails.  Drop the reservation
+         * too, so that its page is not left protected while the handler
+         * runs.
+         */
+        x_monitor_clear_exclusive(ts->x_monitor_node);
+
         /* prepare the stack frame of the virtual CPU */
 #if defined(TARGET_ARCH_HAS_SETUP_FRAME)
         if (sa->sa_flags & TARGET_SA_SIGINFO) {
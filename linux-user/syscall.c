@@ -111,6 +111,7 @@
 #include "qemu/guest-random.h"
 #include "qapi/error.h"
 #include "fd-trans.h"
+#include "x-monitor.h"
 
 #ifndef CLONE_IO
 #define CLONE_IO                0x80000000      /* Clone io context */
@@ -4036,9 +4037,10 @@ static inline abi_ulong do_shmat(CPUArchState *cpu_env,
 
     mmap_lock();
 
-    if (shmaddr)
+    if (shmaddr) {
+        x_monitor_pst_forget(shmaddr, shmaddr + shm_info.shm_segsz);
         host_raddr = shmat(shmid, (void *)g2h(shmaddr), shmflg);
-    else {
+    } else {
         abi_ulong mmap_start;
 
         /* In order to use the host shmat, we need to honor host SHMLBA.  */
@@ -4060,6 +4062,7 @@ static inline abi_ulong do_shmat(CPUArchState *cpu_env,
     page_set_flags(raddr, raddr + shm_info.shm_segsz,
                    PAGE_VALID | PAGE_READ |
                    ((shmflg & SHM_RDONLY)? 0 : PAGE_WRITE));
+    guest_shadow_set_shared(raddr, raddr + shm_info.shm_segsz, true);
 
     for (i = 0; i < N_SHM_REGIONS; i++) {
         if (!shm_regions[i].in_use) {
@@ -4085,7 +4088,10 @@ static inline abi_long do_shmdt(abi_ulong shmaddr)
     for (i = 0; i < N_SHM_REGIONS; ++i) {
         if (shm_regions[i].in_use && shm_regions[i].start == shmaddr) {
             shm_regions[i].in_use = false;
+            x_monitor_pst_forget(shmaddr, shmaddr + shm_regions[i].size);
             page_set_flags(shmaddr, shmaddr + shm_regions[i].size, 0);
+            guest_shadow_set_shared(shmaddr, shmaddr + shm_regions[i].size,
+                                    false);
             break;
         }
     }
@@ -5641,7 +5647,6 @@ typedef struct {
     sigset_t sigmask;
 } new_thread_info;
 
-extern void* x_monitor_register_thread(int tid);
 static void *clone_func(void *arg)
 {
     new_thread_info *info = arg;
@@ -5661,8 +5666,8 @@ static void *clone_func(void *arg)
         put_user_u32(info->tid, info->child_tidptr);
     if (info->parent_tidptr)
         put_user_u32(info->tid, info->parent_tidptr);
-	env->exclusive_tid = info->tid;
-	env->exclusive_node = (uint64_t)x_monitor_register_thread(info->tid);
+    ts->x_monitor_node = x_monitor_register_thread(info->tid);
+    cpu_neg(cpu)->llsc_addr = &ts->x_monitor_node->exclusive_addr;
     qemu_guest_random_seed_thread_part2(cpu->random_seed);
     /* Enable signals.  */
     sigprocmask(SIG_SETMASK, &info->sigmask, NULL);
@@ -5791,7 +5796,9 @@ static int do_fork(CPUArchState *env, unsigned int flags, abi_ulong newsp,
             return -TARGET_ERESTARTSYS;
         }
 
-        fork_start();
+        if (!fork_start()) {
+            return -TARGET_EAGAIN;
+        }
         ret = fork();
         if (ret == 0) {
             /* Child Process.  */
@@ -7223,7 +7230,6 @@ static int host_to_target_cpu_mask(const unsigned long *host_mask,
  * of syscall results, can be performed.
  * All errnos that do_syscall() returns must be -TARGET_<errcode>.
  */
-extern int x_monitor_unregister_thread(int tid);
 static abi_long do_syscall1(void *cpu_env, int num, abi_long arg1,
                             abi_long arg2, abi_long arg3, abi_long arg4,
                             abi_long arg5, abi_long arg6, abi_long arg7,
@@ -7272,9 +7278,9 @@ static abi_long do_syscall1(void *cpu_env, int num, abi_long arg1,
             }
             thread_cpu = NULL;
             object_unref(OBJECT(cpu));
+            x_monitor_unregister_thread(ts->ts_tid);
             g_free(ts);
             rcu_unregister_thread();
-			x_monitor_unregister_thread(((CPUARMState*)cpu)->exclusive_tid);
 
             pthread_exit(NULL);
         }
@@ -8382,12 +8388,15 @@ static abi_long do_syscall1(void *cpu_env, int num, abi_long arg1,
         if (block_signals()) {
             return -TARGET_ERESTARTSYS;
         }
+        /* So does the exception return, see handle_pending_signal.  */
+        x_monitor_clear_exclusive(((TaskState *)cpu->opaque)->x_monitor_node);
         return do_sigreturn(cpu_env);
 #endif
     case TARGET_NR_rt_sigreturn:
         if (block_signals()) {
             return -TARGET_ERESTARTSYS;
         }
+        x_monitor_clear_exclusive(((TaskState *)cpu->opaque)->x_monitor_node);
         return do_rt_sigreturn(cpu_env);
     case TARGET_NR_sethostname:
         if (!(p = lock_user_string(arg1)))
@@ -9259,7 +9268,7 @@ static abi_long do_syscall1(void *cpu_env, int num, abi_long arg1,
         /* new thread calls */
     case TARGET_NR_exit_group:
         preexit_cleanup(cpu_env, arg1);
-		x_monitor_unregister_thread(((CPUARMState*)cpu)->exclusive_tid);
+        x_monitor_unregister_thread(((TaskState *)cpu->opaque)->ts_tid);
         return get_errno(exit_group(arg1));
 #endif
     case TARGET_NR_setdomainname:
@@ -0,0 +1,1370 @@
+/*
+ * Exclusive monitor for ABA-safe LL/SC emulation
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "qemu/osdep.h"
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/userfaultfd.h>
+#include "qemu/atomic.h"
+#include "qemu/log.h"
+#include "qemu/rcu_queue.h"
+#include "qemu/timer.h"
+#include "qapi/qmp/qdict.h"
+#include "qapi/qmp/qjson.h"
+#include "qapi/qmp/qlist.h"
+#include "qapi/qmp/qstring.h"
+
+#include "qemu.h"
+#include "x-monitor.h"
+
+LLSCScheme llsc_scheme = LLSC_TARGET_DEFAULT;
+LLSCRTMMode llsc_rtm_mode = LLSC_RTM_AUTO;
+LLSCWPBackend llsc_wp_backend = LLSC_WP_MPROTECT;
+bool llsc_host_rtm;
+
+uint32_t *llsc_hash_table;
+int llsc_hash_bits = 22;
+LLSCHashFn llsc_hash_fn = LLSC_HASH_WORD;
+uint8_t *llsc_hash_pages;
+
+const char *llsc_stats_path;
+__thread LLSCStats *llsc_thread_stats;
+static __thread int64_t x_mon_sc_lock_start;
+
+/*
+ * Registration is rare, so the list of all threads has a single lock for
+ * writers; it is read under RCU, and nodes are freed through call_rcu.
+ */
+static QemuMutex x_mon_mutex;
+static QLIST_HEAD(, XMonitorNode) x_mon_threads =
+    QLIST_HEAD_INITIALIZER(x_mon_threads);
+static int x_mon_nr_threads;
+
+/*
+ * Statistics of the threads that have exited, kept for the report, and
+ * the time spent with more than one thread.  All under x_mon_mutex.
+ */
+typedef struct XMonitorExited {
+    int tid;
+    LLSCStats stats;
+} XMonitorExited;
+
+static GArray *x_mon_exited;
+static int64_t x_mon_start_ns;
+static int64_t x_mon_multi_start_ns;
+static int64_t x_mon_multi_ns;
+
+/*
+ * Page-indexed radix table of XMonitorPage entries.  Lookups are
+ * lock-free; interior levels and leaves are allocated on first use and
+ * never freed, so an entry pointer stays valid for the process lifetime.
+ */
+#define XMON_INDEX_BITS (TARGET_VIRT_ADDR_SPACE_BITS - TARGET_PAGE_BITS)
+#define XMON_L2_BITS 10
+#define XMON_L2_SIZE (1 << XMON_L2_BITS)
+#define XMON_L1_BITS (((XMON_INDEX_BITS - 1) % XMON_L2_BITS) + 1)
+#define XMON_L1_SIZE (1 << XMON_L1_BITS)
+#define XMON_L1_SHIFT (XMON_INDEX_BITS - XMON_L1_BITS)
+#define XMON_L2_LEVELS (XMON_L1_SHIFT / XMON_L2_BITS - 1)
+
+static void *x_mon_l1_map[XMON_L1_SIZE];
+
+/*
+ * Load-exclusive sites promoted to PST by the hybrid scheme, keyed by
+ * guest PC.  Only looked up at translation time and written on the first
+ * contention at a site, so x_mon_mutex is good enough.
+ */
+static GHashTable *x_mon_hot_sites;
+
+static XMonitorPage *x_monitor_page_find_alloc(target_ulong addr, bool alloc)
+{
+    target_ulong index = addr >> TARGET_PAGE_BITS;
+    XMonitorPage *pd;
+    void **lp;
+    int i;
+
+    /* Level 1.  Always allocated.  */
+    lp = x_mon_l1_map + ((index >> XMON_L1_SHIFT) & (XMON_L1_SIZE - 1));
+
+    /* Level 2..N-1.  */
+    for (i = XMON_L2_LEVELS; i > 0; i--) {
+        void **p = atomic_rcu_read(lp);
+
+        if (p == NULL) {
+            void *existing;
+
+            if (!alloc) {
+                return NULL;
+            }
+            p = g_new0(void *, XMON_L2_SIZE);
+            existing = atomic_cmpxchg(lp, NULL, p);
+            if (unlikely(existing)) {
+                g_free(p);
+                p = existing;
+            }
+        }
+
+        lp = p + ((index >> (i * XMON_L2_BITS)) & (XMON_L2_SIZE - 1));
+    }
+
+    pd = atomic_rcu_read(lp);
+    if (pd == NULL) {
+        void *existing;
+
+        if (!alloc) {
+            return NULL;
+        }
+        pd = qemu_memalign(sizeof(XMonitorPage),
+                           sizeof(XMonitorPage) * XMON_L2_SIZE);
+        memset(pd, 0, sizeof(XMonitorPage) * XMON_L2_SIZE);
+        for (i = 0; i < XMON_L2_SIZE; i++) {
+            qemu_spin_init(&pd[i].lock);
+            QLIST_INIT(&pd[i].nodes);
+        }
+        existing = atomic_cmpxchg(lp, NULL, pd);
+        if (unlikely(existing)) {
+            qemu_vfree(pd);
+            pd = existing;
+        }
+    }
+
+    return pd + (index & (XMON_L2_SIZE - 1));
+}
+
+/*
+ * Break the reservation of P, keeping the page's reservation count in
+ * step.  The xchg makes the owner's store-conditional and a concurrent
+ * clean agree on who drops the reference.
+ */
+static target_ulong x_monitor_drop(XMonitorNode *p)
+{
+    target_ulong old = atomic_xchg(&p->exclusive_addr, 0);
+
+    if (old && p->page) {
+        atomic_dec(&p->page->nr_reserved);
+    }
+    return old;
+}
+
+static void x_monitor_page_unlink(XMonitorNode *p)
+{
+    XMonitorPage *pd = p->page;
+
+    if (pd) {
+        qemu_spin_lock(&pd->lock);
+        x_monitor_drop(p);
+        QLIST_REMOVE(p, page_next);
+        qemu_spin_unlock(&pd->lock);
+        p->page = NULL;
+    }
+}
+
+void x_monitor_show(const char *info)
+{
+    XMonitorNode *p;
+
+    rcu_read_lock();
+    fprintf(stderr, "[x_monitor_show] in  %s\n", info);
+    QLIST_FOREACH_RCU(p, &x_mon_threads, thread_next) {
+        fprintf(stderr, "thread %d x_addr " TARGET_FMT_lx "\n",
+                p->tid, (target_ulong)atomic_read(&p->exclusive_addr));
+    }
+    rcu_read_unlock();
+}
+
+void *x_monitor_register_thread(int tid)
+{
+    XMonitorNode *p;
+
+    qemu_log_mask(CPU_LOG_LLSC, "x_monitor: register thread %d\n", tid);
+    p = qemu_memalign(sizeof(XMonitorNode), sizeof(XMonitorNode));
+    memset(p, 0, sizeof(XMonitorNode));
+    p->tid = tid;
+    if (llsc_stats_path) {
+        llsc_thread_stats = &p->stats;
+    }
+
+    qemu_mutex_lock(&x_mon_mutex);
+    if (++x_mon_nr_threads == 2) {
+        x_mon_multi_start_ns = get_clock();
+    }
+    QLIST_INSERT_HEAD_RCU(&x_mon_threads, p, thread_next);
+    qemu_mutex_unlock(&x_mon_mutex);
+    return p;
+}
+
+static void x_monitor_node_free(XMonitorNode *p)
+{
+    qemu_vfree(p);
+}
+
+/*
+ * Called by the exiting thread itself.  Its reservation and the pages it
+ * queued for unprotection are released before the node is taken off the
+ * thread list, so that nothing it leaves behind keeps a page protected
+ * and the stats of the thread include that work.  The node is freed
+ * after a grace period, as readers of the thread list take no lock.
+ */
+int x_monitor_unregister_thread(int tid)
+{
+    XMonitorNode *p;
+
+    rcu_read_lock();
+    QLIST_FOREACH_RCU(p, &x_mon_threads, thread_next) {
+        if (p->tid == tid) {
+            break;
+        }
+    }
+    rcu_read_unlock();
+    if (p == NULL) {
+        return 1;
+    }
+
+    /* Only the owner removes its node, so it cannot go away meanwhile.  */
+    x_monitor_clear_exclusive(p);
+    x_monitor_pst_flush();
+    x_monitor_page_unlink(p);
+
+    qemu_mutex_lock(&x_mon_mutex);
+    QLIST_REMOVE_RCU(p, thread_next);
+    if (--x_mon_nr_threads == 1) {
+        x_mon_multi_ns += get_clock() - x_mon_multi_start_ns;
+    }
+    if (llsc_stats_path) {
+        XMonitorExited e = { .tid = p->tid, .stats = p->stats };
+
+        g_array_append_val(x_mon_exited, e);
+        if (llsc_thread_stats == &p->stats) {
+            llsc_thread_stats = NULL;
+        }
+    }
+    qemu_mutex_unlock(&x_mon_mutex);
+
+    qemu_log_mask(CPU_LOG_LLSC, "x_monitor: unregister thread %d\n", tid);
+    call_rcu(p, x_monitor_node_free, rcu);
+    return 0;
+}
+
+/* The bits in reserved_lines of the SIZE bytes at ADDR, within one page.  */
+static uint64_t x_monitor_line_mask(target_ulong addr, int size)
+{
+    unsigned first = (addr & ~TARGET_PAGE_MASK) >> XMON_LINE_BITS;
+    unsigned last = ((addr + size - 1) & ~TARGET_PAGE_MASK) >> XMON_LINE_BITS;
+
+    return MAKE_64BIT_MASK(first, last - first + 1);
+}
+
+int x_monitor_set_exclusive_addr(void *p_node, target_ulong addr)
+{
+    XMonitorNode *p = p_node;
+    XMonitorPage *pd = x_monitor_page_find_alloc(addr, true);
+
+    qemu_log_mask(CPU_LOG_LLSC, "x_monitor: thread %d reserves "
+                  TARGET_FMT_lx "\n", p->tid, addr);
+    if (p->page != pd) {
+        x_monitor_page_unlink(p);
+    }
+
+    qemu_spin_lock(&pd->lock);
+    if (p->page != pd) {
+        QLIST_INSERT_HEAD(&pd->nodes, p, page_next);
+        p->page = pd;
+    }
+    if (atomic_xchg(&p->exclusive_addr, addr) == 0) {
+        atomic_inc(&pd->nr_reserved);
+    }
+    pd->reserved_lines |= x_monitor_line_mask(addr, 1);
+    qemu_spin_unlock(&pd->lock);
+    return 0;
+}
+
+int x_monitor_check_exclusive(void *p_node, target_ulong addr)
+{
+    XMonitorNode *p = p_node;
+
+    return x_monitor_drop(p) == addr;
+}
+
+/*
+ * Drop the reservation of P_NODE without a store: CLREX, and the implicit
+ * clear of an exception return.  Its page is then treated as after a
+ * store-conditional.
+ */
+void x_monitor_clear_exclusive(void *p_node)
+{
+    target_ulong addr = x_monitor_drop(p_node);
+
+    if (addr && llsc_uses_pst()) {
+        x_monitor_pst_defer(addr);
+    }
+}
+
+/* Break every reservation on the page; PD must be locked.  */
+void x_monitor_clean_locked(XMonitorPage *pd)
+{
+    XMonitorNode *p;
+
+    if (atomic_read(&pd->nr_reserved) == 0) {
+        return;
+    }
+    QLIST_FOREACH(p, &pd->nodes, page_next) {
+        x_monitor_drop(p);
+        qemu_log_mask(CPU_LOG_LLSC, "x_monitor: break reservation of "
+                      "thread %d\n", p->tid);
+    }
+    pd->reserved_lines = 0;
+}
+
+int x_monitor_check_and_clean(int tid, target_ulong addr)
+{
+    XMonitorPage *pd = x_monitor_page_find_alloc(addr, false);
+
+    if (pd == NULL) {
+        /* nobody ever reserved this page */
+        return 0;
+    }
+
+    qemu_spin_lock(&pd->lock);
+    x_monitor_clean_locked(pd);
+    qemu_spin_unlock(&pd->lock);
+    return 0;
+}
+
+/*
+ * Lock the monitor entry of the page containing ADDR.  While it is held
+ * no reservation on the page can be set or broken, which lets a
+ * store-conditional check its reservation and store atomically with
+ * respect to the fault handler.
+ */
+XMonitorPage *x_monitor_page_lock(target_ulong addr)
+{
+    XMonitorPage *pd = x_monitor_page_find_alloc(addr, true);
+
+    qemu_spin_lock(&pd->lock);
+    return pd;
+}
+
+void x_monitor_page_unlock(XMonitorPage *pd)
+{
+    qemu_spin_unlock(&pd->lock);
+}
+
+/*
+ * g_sc_lock, with the time it is held counted when statistics are on.
+ * The clock is read after taking the lock, so waiting is not included.
+ */
+void x_monitor_sc_lock(void)
+{
+    pthread_mutex_lock(&g_sc_lock);
+    if (llsc_thread_stats) {
+        x_mon_sc_lock_start = get_clock();
+    }
+}
+
+void x_monitor_sc_unlock(void)
+{
+    if (llsc_thread_stats) {
+        llsc_stat_add(LLSC_STAT_SC_LOCK_NS,
+                      get_clock() - x_mon_sc_lock_start);
+    }
+    pthread_mutex_unlock(&g_sc_lock);
+}
+
+/* Userfaultfd write protection, Linux 5.7 (5.19 for shmem).  */
+#ifndef UFFDIO_WRITEPROTECT
+#define _UFFDIO_WRITEPROTECT (0x06)
+struct uffdio_writeprotect {
+    struct uffdio_range range;
+    uint64_t mode;
+};
+#define UFFDIO_WRITEPROTECT_MODE_WP       ((uint64_t)1 << 0)
+#define UFFDIO_WRITEPROTECT_MODE_DONTWAKE ((uint64_t)1 << 1)
+#define UFFDIO_WRITEPROTECT _IOWR(UFFDIO, _UFFDIO_WRITEPROTECT, \
+                                  struct uffdio_writeprotect)
+#endif
+#ifndef UFFD_FEATURE_WP_HUGETLBFS_SHMEM
+#define UFFD_FEATURE_WP_HUGETLBFS_SHMEM (1 << 12)
+#endif
+#ifndef UFFD_USER_MODE_ONLY
+#define UFFD_USER_MODE_ONLY 1
+#endif
+
+/*
+ * With -llsc-wp uffd, pages that live in the shadow memfd are registered
+ * with a userfaultfd once, when first protected, and from then on are
+ * protected and unprotected with UFFDIO_WRITEPROTECT instead of mprotect,
+ * which never splits a VMA.  A conflicting store blocks in the kernel
+ * until the fault thread has broken the reservations and lifted the
+ * protection; no signal is involved.  The -1 fd means mprotect only.
+ */
+static int x_mon_uffd = -1;
+static QemuThread x_mon_uffd_thread;
+static int x_mon_uffd_tid;
+static LLSCStats x_mon_uffd_stats;
+
+/*
+ * PST page protection.  A host page is write-protected when a reservation
+ * is taken on one of its guest pages while it is unprotected, and
+ * unprotected when a store faults and breaks every reservation on it, or
+ * when the last reservation is dropped without one.  The latter is
+ * batched per thread (see x_monitor_pst_defer), as the next load-exclusive
+ * on a hot lock would only protect the page again.
+ *
+ * The protection is a host-only affair: the guest page flags keep
+ * PAGE_WRITE, so SMC tracking and page_unprotect() never see it, and the
+ * state lives in pst_state of the entry of the first guest page of the
+ * host page.  The fault handler resolves a fault from that state alone,
+ * with atomics, the page entry spin locks and mprotect, all of which are
+ * safe in signal context; it never takes g_sc_lock or mmap_lock.
+ * Whoever moves the state to XMON_PST_BUSY owns the host protection until
+ * it moves it out again, and faults on a busy page are simply retried.
+ */
+static XMonitorPage *x_monitor_pst_entry(target_ulong addr, bool alloc)
+{
+    return x_monitor_page_find_alloc(addr & qemu_host_page_mask, alloc);
+}
+
+/* The host protection the guest page flags ask for at host page PAGE.  */
+static int x_monitor_host_prot(target_ulong page)
+{
+    target_ulong a;
+    int prot = 0;
+
+    for (a = page; a - page < qemu_host_page_size; a += TARGET_PAGE_SIZE) {
+        prot |= page_get_flags(a);
+    }
+    return prot & PAGE_BITS;
+}
+
+/*
+ * Break every reservation on the guest pages of host page PAGE.  Unlike
+ * x_monitor_clean_locked it does not log, as it runs in signal context.
+ */
+static void x_monitor_clean_host_page(target_ulong page)
+{
+    target_ulong a;
+    XMonitorNode *p;
+
+    for (a = page; a - page < qemu_host_page_size; a += TARGET_PAGE_SIZE) {
+        XMonitorPage *pd = x_monitor_page_find_alloc(a, false);
+
+        if (pd && atomic_read(&pd->nr_reserved)) {
+            qemu_spin_lock(&pd->lock);
+            QLIST_FOREACH(p, &pd->nodes, page_next) {
+                x_monitor_drop(p);
+            }
+            pd->reserved_lines = 0;
+            qemu_spin_unlock(&pd->lock);
+        }
+    }
+}
+
+/* Move the PST state of PD to busy; returns the state it had.  */
+static int x_monitor_pst_claim(XMonitorPage *pd)
+{
+    int state;
+
+    for (;;) {
+        state = atomic_read(&pd->pst_state);
+        if (state != XMON_PST_BUSY &&
+            atomic_cmpxchg(&pd->pst_state, state, XMON_PST_BUSY) == state) {
+            return state;
+        }
+        cpu_relax();
+    }
+}
+
+static bool x_monitor_uffd_register(target_ulong page)
+{
+    struct uffdio_register arg = {
+        .range.start = (uintptr_t)g2h(page),
+        .range.len = qemu_host_page_size,
+        .mode = UFFDIO_REGISTER_MODE_WP,
+    };
+
+    return ioctl(x_mon_uffd, UFFDIO_REGISTER, &arg) == 0 &&
+           (arg.ioctls & ((uint64_t)1 << _UFFDIO_WRITEPROTECT));
+}
+
+/* Set or clear the write protection of host page PAGE; clearing wakes.  */
+static bool x_monitor_uffd_wp(target_ulong page, bool wp)
+{
+    struct uffdio_writeprotect arg = {
+        .range.start = (uintptr_t)g2h(page),
+        .range.len = qemu_host_page_size,
+        .mode = wp ? UFFDIO_WRITEPROTECT_MODE_WP : 0,
+    };
+
+    llsc_stat_inc(LLSC_STAT_UFFD_WP);
+    return ioctl(x_mon_uffd, UFFDIO_WRITEPROTECT, &arg) == 0;
+}
+
+/*
+ * Write-protect host page PAGE, whose entry PD the caller holds busy,
+ * and alias it to the shadow.  FLAGS are the guest flags of the page.
+ * Returns false if the page could not be protected.
+ */
+static bool x_monitor_pst_wp(XMonitorPage *pd, target_ulong page, int flags)
+{
+    if (pd->pst_uffd) {
+        if (!(flags & PAGE_WRITE) || x_monitor_uffd_wp(page, true)) {
+            return true;
+        }
+        pd->pst_uffd = false;
+    }
+
+    if (flags & PAGE_WRITE) {
+        llsc_stat_inc(LLSC_STAT_MPROTECT);
+        if (mprotect(g2h(page), qemu_host_page_size,
+                     x_monitor_host_prot(page) & ~PAGE_WRITE)) {
+            return false;
+        }
+    }
+    /* Nobody can write the page now, so it can join the shadow.  */
+    guest_shadow_adopt(page);
+
+    if (x_mon_uffd >= 0 && (flags & PAGE_WRITE) && guest_shadow_page(page) &&
+        x_monitor_uffd_register(page) && x_monitor_uffd_wp(page, true)) {
+        /* The userfaultfd keeps it protected from now on.  */
+        mprotect(g2h(page), qemu_host_page_size, x_monitor_host_prot(page));
+        llsc_stat_inc(LLSC_STAT_MPROTECT);
+        pd->pst_uffd = true;
+    }
+    return true;
+}
+
+/*
+ * Write-protect the host page containing ADDR and alias it to the shadow.
+ * Callers hold g_sc_lock.
+ */
+void x_monitor_pst_protect(target_ulong addr)
+{
+    target_ulong page = addr & qemu_host_page_mask;
+    XMonitorPage *pd = x_monitor_pst_entry(addr, true);
+    int flags, state;
+
+    /*
+     * The state is a cache of the host protection: XMON_PST_PROTECTED is
+     * only ever published while the host page is write-protected, so it
+     * can be trusted without a system call.
+     */
+    if (atomic_read(&pd->pst_state) == XMON_PST_PROTECTED) {
+        return;
+    }
+
+    /* Keeps the page flags and mapping still, see x_monitor_pst_forget.  */
+    mmap_lock();
+    flags = page_get_flags(addr);
+    /*
+     * A page the guest cannot write needs no protection.  A code page
+     * made read-only for SMC detection is already read-only on the host
+     * and only needs the state, so that its next store breaks the
+     * reservations before page_unprotect() sees it.
+     */
+    if (flags & PAGE_WRITE_ORG) {
+        state = XMON_PST_PROTECTED;
+        if (x_monitor_pst_claim(pd) != XMON_PST_PROTECTED &&
+            !x_monitor_pst_wp(pd, page, flags)) {
+            /* Unmonitored, so the store-conditional must fail.  */
+            x_monitor_clean_host_page(page);
+            state = XMON_PST_NONE;
+        }
+        atomic_mb_set(&pd->pst_state, state);
+    }
+    mmap_unlock();
+}
+
+/*
+ * Sub-page conflict detection.  A store that faults on a protected page
+ * only breaks the reservations on the lines it writes.  If others remain
+ * on the page, the store is done here through the shadow alias and the
+ * page stays protected, so that stores to the fields next to a lock do
+ * not cost the lock holder its reservation.  This needs the store to have
+ * been decoded, the page to be in the shadow and not SMC-protected, and
+ * host and guest pages of the same size.  Returns false if the page must
+ * be unprotected instead.
+ */
+static bool x_monitor_pst_emulate(const XMonitorStore *st)
+{
+    target_ulong addr = st->addr;
+    XMonitorPage *pd;
+    XMonitorNode *p;
+    uint64_t mask;
+    void *host;
+
+    if (qemu_host_page_size != TARGET_PAGE_SIZE ||
+        ((addr ^ (addr + st->size - 1)) & TARGET_PAGE_MASK) ||
+        !guest_shadow_page(addr) || !(page_get_flags(addr) & PAGE_WRITE)) {
+        return false;
+    }
+    pd = x_monitor_page_find_alloc(addr, false);
+    if (pd == NULL) {
+        return false;
+    }
+    mask = x_monitor_line_mask(addr, st->size);
+
+    qemu_spin_lock(&pd->lock);
+    if (pd->reserved_lines & mask) {
+        pd->reserved_lines = 0;
+        QLIST_FOREACH(p, &pd->nodes, page_next) {
+            target_ulong x = atomic_read(&p->exclusive_addr);
+
+            if (x && (x_monitor_line_mask(x, 1) & mask)) {
+                x_monitor_drop(p);
+            } else if (x) {
+                pd->reserved_lines |= x_monitor_line_mask(x, 1);
+            }
+        }
+    }
+    if (atomic_read(&pd->nr_reserved) == 0) {
+        /* nothing left worth the protection */
+        qemu_spin_unlock(&pd->lock);
+        return false;
+    }
+
+    host = g2shadow(addr);
+    switch (st->size) {
+    case 1:
+        stb_p(host, st->val);
+        break;
+    case 2:
+        stw_he_p(host, st->val);
+        break;
+    case 4:
+        stl_he_p(host, st->val);
+        break;
+    default:
+        stq_he_p(host, st->val);
+        break;
+    }
+    qemu_spin_unlock(&pd->lock);
+    llsc_stat_inc(LLSC_STAT_PST_EMULATED);
+    return true;
+}
+
+/*
+ * Called by the SIGSEGV handler for a fault at guest address ADDR, with
+ * the decoded store ST if there is one.  Must stay async-signal-safe.
+ */
+XMonitorFault x_monitor_pst_fault(target_ulong addr, bool is_write,
+                                  const XMonitorStore *st)
+{
+    target_ulong page = addr & qemu_host_page_mask;
+    XMonitorPage *pd = x_monitor_pst_entry(addr, false);
+    int state;
+
+    if (pd == NULL) {
+        return XMON_FAULT_FOREIGN;
+    }
+    state = atomic_read(&pd->pst_state);
+    if (state == XMON_PST_BUSY) {
+        /* protected, unprotected or moved aside right now: retry */
+        return XMON_FAULT_RETRY;
+    }
+    if (state != XMON_PST_PROTECTED || !is_write) {
+        return XMON_FAULT_FOREIGN;
+    }
+
+    llsc_stat_inc(LLSC_STAT_PST_FAULT);
+    if (st && x_monitor_pst_emulate(st)) {
+        return XMON_FAULT_EMULATED;
+    }
+    if (atomic_cmpxchg(&pd->pst_state, XMON_PST_PROTECTED,
+                       XMON_PST_BUSY) != XMON_PST_PROTECTED) {
+        /* another thread is unprotecting it */
+        return XMON_FAULT_RETRY;
+    }
+
+    x_monitor_clean_host_page(page);
+    /*
+     * Restore what the guest asked for.  If that is read-only (an SMC
+     * protected code page), the restarted store faults again and goes to
+     * page_unprotect() with the state clear.
+     */
+    mprotect(g2h(page), qemu_host_page_size, x_monitor_host_prot(page));
+    llsc_stat_inc(LLSC_STAT_MPROTECT);
+    atomic_mb_set(&pd->pst_state, XMON_PST_NONE);
+    return XMON_FAULT_RETRY;
+}
+
+/*
+ * Keep the host page containing ADDR busy while a store-conditional moves
+ * it aside; returns the state to hand back to x_monitor_pst_release.
+ */
+int x_monitor_pst_hold(target_ulong addr)
+{
+    return x_monitor_pst_claim(x_monitor_pst_entry(addr, true));
+}
+
+/*
+ * Hand back the state taken by x_monitor_pst_hold.  The page was moved
+ * back from a writable mapping, so its host protection is put back to
+ * what STATE and the page flags say before anyone can see the state.
+ */
+void x_monitor_pst_release(target_ulong addr, int state)
+{
+    target_ulong page = addr & qemu_host_page_mask;
+    XMonitorPage *pd = x_monitor_pst_entry(addr, true);
+    int prot = x_monitor_host_prot(page);
+
+    if (!pd->pst_uffd) {
+        if (state == XMON_PST_PROTECTED) {
+            prot &= ~PAGE_WRITE;
+        }
+        llsc_stat_inc(LLSC_STAT_MPROTECT);
+        if (mprotect(g2h(page), qemu_host_page_size, prot) &&
+            state == XMON_PST_PROTECTED) {
+            /* Left writable: nothing on it is monitored any more.  */
+            x_monitor_clean_host_page(page);
+            state = XMON_PST_NONE;
+        }
+    }
+    atomic_mb_set(&pd->pst_state, state);
+}
+
+/*
+ * Host pages left protected with no reservation on them, queued by the
+ * store-conditionals of this thread and unprotected in a batch when it
+ * leaves the translated code.  A page that has been reserved again by
+ * then is left alone; one unprotected meanwhile by a fault is skipped.
+ */
+#define XMON_UNPROTECT_BATCH 16
+
+static __thread target_ulong x_mon_unprotect[XMON_UNPROTECT_BATCH];
+static __thread int x_mon_nr_unprotect;
+
+/* Whether any guest page of host page PAGE holds a reservation.  */
+static bool x_monitor_host_page_reserved(target_ulong page)
+{
+    target_ulong a;
+
+    for (a = page; a - page < qemu_host_page_size; a += TARGET_PAGE_SIZE) {
+        XMonitorPage *pd = x_monitor_page_find_alloc(a, false);
+
+        if (pd && atomic_read(&pd->nr_reserved)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * Lift the protection of host page PAGE if it is still protected and
+ * unreserved.  The reservation count is read after the page is claimed:
+ * a load-exclusive that raced ahead of the claim is seen here, and one
+ * that came after it finds the page busy or unprotected and protects it
+ * again itself.
+ */
+static void x_monitor_pst_unprotect_idle(target_ulong page)
+{
+    XMonitorPage *pd = x_monitor_pst_entry(page, false);
+
+    if (pd == NULL ||
+        atomic_cmpxchg(&pd->pst_state, XMON_PST_PROTECTED,
+                       XMON_PST_BUSY) != XMON_PST_PROTECTED) {
+        return;
+    }
+    if (x_monitor_host_page_reserved(page) ||
+        (pd->pst_uffd && !x_monitor_uffd_wp(page, false))) {
+        atomic_mb_set(&pd->pst_state, XMON_PST_PROTECTED);
+        return;
+    }
+    if (!pd->pst_uffd) {
+        mprotect(g2h(page), qemu_host_page_size, x_monitor_host_prot(page));
+        llsc_stat_inc(LLSC_STAT_MPROTECT);
+    }
+    llsc_stat_inc(LLSC_STAT_PST_UNPROTECT);
+    atomic_mb_set(&pd->pst_state, XMON_PST_NONE);
+}
+
+/*
+ * Called after a store-conditional at ADDR: queue its host page for
+ * unprotection if no reservation is left on it.
+ */
+void x_monitor_pst_defer(target_ulong addr)
+{
+    target_ulong page = addr & qemu_host_page_mask;
+    XMonitorPage *pd = x_monitor_pst_entry(page, false);
+    int i;
+
+    if (pd == NULL ||
+        atomic_read(&pd->pst_state) != XMON_PST_PROTECTED ||
+        x_monitor_host_page_reserved(page)) {
+        return;
+    }
+    for (i = 0; i < x_mon_nr_unprotect; i++) {
+        if (x_mon_unprotect[i] == page) {
+            return;
+        }
+    }
+    if (x_mon_nr_unprotect == XMON_UNPROTECT_BATCH) {
+        x_monitor_pst_flush();
+    }
+    x_mon_unprotect[x_mon_nr_unprotect++] = page;
+}
+
+/*
+ * Unprotect the pages queued by x_monitor_pst_defer.  Called from the
+ * cpu_loop of every target with PST support (Arm, AArch64, RISC-V, MIPS
+ * and PowerPC) each time the thread leaves the translated code, which
+ * includes every syscall, and at thread exit.
+ */
+void x_monitor_pst_flush(void)
+{
+    int i;
+
+    for (i = 0; i < x_mon_nr_unprotect; i++) {
+        x_monitor_pst_unprotect_idle(x_mon_unprotect[i]);
+    }
+    x_mon_nr_unprotect = 0;
+}
+
+/*
+ * The guest mapping or protection of [start, end) is about to change.
+ * Drop the PST state of its host pages and break their reservations; the
+ * caller sets the new host protection.  Called with mmap_lock held, which
+ * keeps x_monitor_pst_protect out until the page flags are updated.
+ */
+void x_monitor_pst_forget(target_ulong start, target_ulong end)
+{
+    target_ulong page;
+
+    if (!llsc_uses_pst()) {
+        return;
+    }
+    for (page = start & qemu_host_page_mask; page < end;
+         page += qemu_host_page_size) {
+        XMonitorPage *pd = x_monitor_pst_entry(page, false);
+
+        if (pd && (atomic_read(&pd->pst_state) != XMON_PST_NONE ||
+                   pd->pst_uffd)) {
+            if (x_monitor_pst_claim(pd) == XMON_PST_PROTECTED &&
+                pd->pst_uffd) {
+                x_monitor_uffd_wp(page, false);
+            }
+            /* the registration does not survive a new mapping */
+            pd->pst_uffd = false;
+            x_monitor_clean_host_page(page);
+            atomic_mb_set(&pd->pst_state, XMON_PST_NONE);
+        }
+        if (page + qemu_host_page_size < page) {
+            break;
+        }
+    }
+}
+
+/*
+ * A store to a page protected through the userfaultfd.  Unlike the
+ * SIGSEGV path this runs in an ordinary thread, so it can wait for a
+ * busy page.  Messages can be stale, e.g. for a page that has been
+ * unprotected and protected again since; breaking its reservations then
+ * only costs a spurious store-conditional failure.
+ */
+static void x_monitor_uffd_fault(target_ulong addr)
+{
+    target_ulong page = addr & qemu_host_page_mask;
+    XMonitorPage *pd = x_monitor_pst_entry(addr, true);
+    int state = x_monitor_pst_claim(pd);
+
+    if (!pd->pst_uffd) {
+        /* protected with mprotect by now: just let the store retry */
+        struct uffdio_range range = {
+            .start = (uintptr_t)g2h(page),
+            .len = qemu_host_page_size,
+        };
+
+        ioctl(x_mon_uffd, UFFDIO_WAKE, &range);
+        atomic_mb_set(&pd->pst_state, state);
+        return;
+    }
+    if (state == XMON_PST_PROTECTED) {
+        llsc_stat_inc(LLSC_STAT_PST_FAULT);
+        x_monitor_clean_host_page(page);
+    }
+    x_monitor_uffd_wp(page, false);
+    atomic_mb_set(&pd->pst_state, XMON_PST_NONE);
+}
+
+static void *x_monitor_uffd_thread_fn(void *arg)
+{
+    struct uffd_msg msg;
+    ssize_t len;
+
+    if (llsc_stats_path) {
+        llsc_thread_stats = &x_mon_uffd_stats;
+    }
+    atomic_set(&x_mon_uffd_tid, qemu_get_thread_id());
+
+    for (;;) {
+        len = read(x_mon_uffd, &msg, sizeof(msg));
+        if (len < 0 && errno == EINTR) {
+            continue;
+        }
+        if (len != sizeof(msg)) {
+            break;
+        }
+        if (msg.event == UFFD_EVENT_PAGEFAULT &&
+            (msg.arg.pagefault.flags & UFFD_PAGEFAULT_FLAG_WP) &&
+            h2g_valid(msg.arg.pagefault.address)) {
+            x_monitor_uffd_fault(h2g(msg.arg.pagefault.address));
+        }
+    }
+    qemu_log_mask(CPU_LOG_LLSC, "x_monitor: userfaultfd read failed: %s\n",
+                  strerror(errno));
+    return NULL;
+}
+
+/*
+ * Set up the -llsc-wp backend once the options are parsed.  Without
+ * userfaultfd write protection for shmem, PST quietly uses mprotect.
+ */
+void x_monitor_wp_init(void)
+{
+    struct uffdio_api api = { .api = UFFD_API };
+    int fd;
+
+    if (llsc_wp_backend != LLSC_WP_UFFD || !llsc_uses_pst()) {
+        return;
+    }
+
+    fd = syscall(__NR_userfaultfd, O_CLOEXEC);
+    if (fd < 0) {
+        /* unprivileged processes may only trap user-mode faults */
+        fd = syscall(__NR_userfaultfd, O_CLOEXEC | UFFD_USER_MODE_ONLY);
+    }
+    if (fd < 0 || ioctl(fd, UFFDIO_API, &api) ||
+        !(api.features & UFFD_FEATURE_PAGEFAULT_FLAG_WP) ||
+        !(api.features & UFFD_FEATURE_WP_HUGETLBFS_SHMEM)) {
+        qemu_log_mask(CPU_LOG_LLSC, "x_monitor: no userfaultfd write "
+                      "protection, using mprotect\n");
+        if (fd >= 0) {
+            close(fd);
+        }
+        llsc_wp_backend = LLSC_WP_MPROTECT;
+        return;
+    }
+
+    x_mon_uffd = fd;
+    qemu_thread_create(&x_mon_uffd_thread, "llsc-uffd",
+                       x_monitor_uffd_thread_fn, NULL, QEMU_THREAD_DETACHED);
+}
+
+/*
+ * Transactional store-conditional.  The transaction reads the lock of the
+ * page entry, the same way lock elision does, so anybody who takes the
+ * lock while it runs (the fault handler, a reservation, a lock-based
+ * store-conditional) aborts it.  Both LEN-byte images CMPV and NEWV are
+ * in guest memory order; memcmp and memcpy are fine here because the
+ * transaction makes the whole store visible at once.
+ */
+#ifdef CONFIG_RTM_OPT
+#pragma GCC push_options
+#pragma GCC target("rtm")
+#include <immintrin.h>
+#include "qemu/cpuid.h"
+
+#define XMON_RTM_RETRIES 4
+/* _xabort code when the page entry is locked */
+#define XMON_RTM_BUSY    0x01
+
+static XMonitorRTMResult x_monitor_rtm_sc_txn(XMonitorNode *p,
+                                              XMonitorPage *pd,
+                                              target_ulong addr, void *host,
+                                              int len, const void *cmpv,
+                                              const void *newv,
+                                              uint32_t *tag, uint32_t *tag_hi,
+                                              unsigned *status)
+{
+    XMonitorNode *q;
+    int dropped = 0;
+    bool ok;
+
+    *status = _xbegin();
+    if (*status != _XBEGIN_STARTED) {
+        return XMON_RTM_FALLBACK;
+    }
+    if (qemu_spin_locked(&pd->lock)) {
+        _xabort(XMON_RTM_BUSY);
+    }
+    if (atomic_read(&p->exclusive_addr) != addr ||
+        (tag && atomic_read(tag) != (uint32_t)p->tid) ||
+        (tag_hi && atomic_read(tag_hi) != (uint32_t)p->tid)) {
+        _xend();
+        llsc_stat_sc(LLSC_STAT_SC_FAIL_LOST);
+        return XMON_RTM_FAILED;
+    }
+    /* As x_monitor_clean_locked: break every reservation, ours included.  */
+    QLIST_FOREACH(q, &pd->nodes, page_next) {
+        if (atomic_read(&q->exclusive_addr)) {
+            atomic_set(&q->exclusive_addr, 0);
+            dropped++;
+        }
+    }
+    atomic_set(&pd->nr_reserved, atomic_read(&pd->nr_reserved) - dropped);
+    ok = !memcmp(host, cmpv, len);
+    if (ok) {
+        memcpy(host, newv, len);
+    }
+    _xend();
+    /* Counted out of the transaction, which need not touch our stats.  */
+    llsc_stat_sc(ok ? LLSC_STAT_SC_OK : LLSC_STAT_SC_FAIL_VALUE);
+    return ok ? XMON_RTM_STORED : XMON_RTM_FAILED;
+}
+
+static bool x_monitor_rtm_retry(unsigned status, int attempt)
+{
+    if (attempt + 1 >= XMON_RTM_RETRIES || !(status & _XABORT_RETRY)) {
+        qemu_log_mask(CPU_LOG_LLSC, "x_monitor: rtm abort status %x, "
+                      "falling back\n", status);
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Leaf 7 advertises RTM; RTM_ALWAYS_ABORT is set on hosts where TSX was
+ * disabled by microcode and every transaction would abort anyway.
+ */
+static bool x_monitor_host_has_rtm(void)
+{
+    int max = __get_cpuid_max(0, NULL);
+    int a, b, c, d;
+
+    if (max < 7) {
+        return false;
+    }
+    __cpuid_count(7, 0, a, b, c, d);
+    return (b & bit_RTM) && !(d & bit_RTM_ALWAYS_ABORT);
+}
+#pragma GCC pop_options
+#endif /* CONFIG_RTM_OPT */
+
+/*
+ * Store-conditional of the thread owning P_NODE.  HOST must be a writable
+ * view of ADDR, e.g. the shadow alias of a PST-protected page.  Under the
+ * hst scheme, the hash entries TAG and TAG_HI, if not NULL, must also
+ * still hold the thread's id.
+ */
+XMonitorRTMResult x_monitor_rtm_sc(void *p_node, target_ulong addr,
+                                   void *host, int len,
+                                   const void *cmpv, const void *newv,
+                                   uint32_t *tag, uint32_t *tag_hi)
+{
+#ifdef CONFIG_RTM_OPT
+    XMonitorPage *pd;
+    XMonitorRTMResult res;
+    unsigned status;
+    int i;
+
+    if (llsc_rtm_mode == LLSC_RTM_ABORT) {
+        return XMON_RTM_FALLBACK;
+    }
+    pd = x_monitor_page_find_alloc(addr, true);
+    for (i = 0; ; i++) {
+        res = x_monitor_rtm_sc_txn(p_node, pd, addr, host, len, cmpv, newv,
+                                   tag, tag_hi, &status);
+        if (res != XMON_RTM_FALLBACK || !x_monitor_rtm_retry(status, i)) {
+            return res;
+        }
+    }
+#else
+    return XMON_RTM_FALLBACK;
+#endif
+}
+
+/*
+ * Hybrid scheme policy.  A load-exclusive site starts out with the plain
+ * cmpxchg emulation, which cannot see ABA.  The first time one of its
+ * store-conditionals fails, the site is taken to be contended: it is
+ * recorded as hot and its translation is thrown away, so the next
+ * execution is retranslated with the PST monitor.  Promotion is sticky.
+ */
+bool x_monitor_site_is_hot(target_ulong pc)
+{
+    bool hot;
+
+    qemu_mutex_lock(&x_mon_mutex);
+    hot = g_hash_table_contains(x_mon_hot_sites, (gpointer)(uintptr_t)pc);
+    qemu_mutex_unlock(&x_mon_mutex);
+    return hot;
+}
+
+void x_monitor_site_contended(target_ulong pc)
+{
+    bool added;
+
+    qemu_mutex_lock(&x_mon_mutex);
+    added = g_hash_table_add(x_mon_hot_sites, (gpointer)(uintptr_t)pc);
+    qemu_mutex_unlock(&x_mon_mutex);
+
+    if (added) {
+        mmap_lock();
+        tb_invalidate_phys_range(pc, pc + 1);
+        mmap_unlock();
+    }
+}
+
+static void *llsc_hash_alloc(size_t size)
+{
+    void *p;
+
+    /* Only the parts that are actually touched get backed.  */
+    p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (p == MAP_FAILED) {
+        fprintf(stderr, "Unable to allocate the LL/SC hash table: %s\n",
+                strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    return p;
+}
+
+void llsc_hash_init(void)
+{
+    llsc_hash_table = llsc_hash_alloc((size_t)4 << llsc_hash_bits);
+    /* AArch32 only: the guest address space is 32 bits.  */
+    llsc_hash_pages = llsc_hash_alloc((size_t)1 << (32 - TARGET_PAGE_BITS));
+}
+
+static const char * const llsc_stat_names[LLSC_STAT__MAX] = {
+    [LLSC_STAT_LL] = "ll",
+    [LLSC_STAT_SC] = "sc",
+    [LLSC_STAT_SC_OK] = "sc_ok",
+    [LLSC_STAT_SC_FAIL_ADDR] = "sc_fail_addr",
+    [LLSC_STAT_SC_FAIL_VALUE] = "sc_fail_value",
+    [LLSC_STAT_SC_FAIL_LOST] = "sc_fail_lost",
+    [LLSC_STAT_PST_FAULT] = "pst_faults",
+    [LLSC_STAT_PST_EMULATED] = "pst_emulated",
+    [LLSC_STAT_PST_UNPROTECT] = "pst_unprotects",
+    [LLSC_STAT_MPROTECT] = "mprotects",
+    [LLSC_STAT_UFFD_WP] = "uffd_wp",
+    [LLSC_STAT_SC_LOCK_NS] = "sc_lock_ns",
+};
+
+static const char * const llsc_scheme_names[] = {
+    [LLSC_CMPXCHG] = "cmpxchg",
+    [LLSC_HST] = "hst",
+    [LLSC_PST] = "pst",
+    [LLSC_EXCP] = "excp",
+    [LLSC_HYBRID] = "hybrid",
+};
+
+/* Add STATS into TOTAL and return them as a dictionary for thread TID.  */
+static QDict *x_monitor_stats_dict(int tid, const LLSCStats *stats,
+                                   LLSCStats *total)
+{
+    QDict *d = qdict_new();
+    int i;
+
+    qdict_put_int(d, "tid", tid);
+    for (i = 0; i < LLSC_STAT__MAX; i++) {
+        uint64_t v = atomic_read__nocheck(&stats->count[i]);
+
+        qdict_put_int(d, llsc_stat_names[i], v);
+        total->count[i] += v;
+    }
+    return d;
+}
+
+/*
+ * Write the -llsc-stats report: the counters of every thread, live or
+ * exited, and their sum.  Threads still running may be counting while
+ * this reads, which only makes the report a little stale.
+ */
+void x_monitor_stats_report(void)
+{
+    LLSCStats total = { };
+    QDict *report, *sum;
+    QList *threads;
+    QString *json;
+    XMonitorNode *p;
+    int64_t now, multi_ns;
+    FILE *f;
+    int i;
+
+    if (!llsc_stats_path) {
+        return;
+    }
+
+    threads = qlist_new();
+    qemu_mutex_lock(&x_mon_mutex);
+    for (i = 0; i < x_mon_exited->len; i++) {
+        XMonitorExited *e = &g_array_index(x_mon_exited, XMonitorExited, i);
+
+        qlist_append(threads, x_monitor_stats_dict(e->tid, &e->stats, &total));
+    }
+    QLIST_FOREACH(p, &x_mon_threads, thread_next) {
+        qlist_append(threads, x_monitor_stats_dict(p->tid, &p->stats, &total));
+    }
+    if (x_mon_uffd >= 0) {
+        qlist_append(threads,
+                     x_monitor_stats_dict(atomic_read(&x_mon_uffd_tid),
+                                          &x_mon_uffd_stats, &total));
+    }
+    now = get_clock();
+    multi_ns = x_mon_multi_ns;
+    if (x_mon_nr_threads > 1) {
+        multi_ns += now - x_mon_multi_start_ns;
+    }
+    qemu_mutex_unlock(&x_mon_mutex);
+
+    sum = qdict_new();
+    for (i = 0; i < LLSC_STAT__MAX; i++) {
+        qdict_put_int(sum, llsc_stat_names[i], total.count[i]);
+    }
+
+    report = qdict_new();
+    qdict_put_str(report, "scheme", llsc_scheme_names[llsc_scheme]);
+    qdict_put_str(report, "wp_backend",
+                  llsc_wp_backend == LLSC_WP_UFFD ? "uffd" : "mprotect");
+    qdict_put_int(report, "wall_ns", now - x_mon_start_ns);
+    qdict_put_int(report, "multi_thread_ns", multi_ns);
+    qdict_put(report, "total", sum);
+    qdict_put(report, "threads", threads);
+    json = qobject_to_json_pretty(QOBJECT(report));
+
+    if (!strcmp(llsc_stats_path, "-")) {
+        f = stderr;
+    } else {
+        f = fopen(llsc_stats_path, "w");
+    }
+    if (f) {
+        fprintf(f, "%s\n", qstring_get_str(json));
+        if (f != stderr) {
+            fclose(f);
+        }
+    } else {
+        fprintf(stderr, "Unable to write LL/SC statistics to %s: %s\n",
+                llsc_stats_path, strerror(errno));
+    }
+    qobject_unref(json);
+    qobject_unref(report);
+}
+
+/*
+ * Fork.  The thread list and g_sc_lock are held across it, and the vCPUs
+ * are stopped, so the child inherits no half-made reservation.  The
+ * userfaultfd fault thread is not stopped, though, and the child may
+ * find page entries it left locked or busy; besides, the child has
+ * neither that thread nor the registrations of the parent's mm.  So
+ * every page entry is reset and every protected page is given back the
+ * protection its guest flags ask for.  Its shadow pages have already
+ * been made private by guest_shadow_fork_child().
+ */
+void x_monitor_fork_start(void)
+{
+    pthread_mutex_lock(&g_sc_lock);
+    qemu_mutex_lock(&x_mon_mutex);
+}
+
+static void x_monitor_fork_reset_page(XMonitorPage *pd, target_ulong addr)
+{
+    qemu_spin_init(&pd->lock);
+    QLIST_INIT(&pd->nodes);
+    pd->nr_reserved = 0;
+    pd->reserved_lines = 0;
+    pd->pst_uffd = false;
+    if (pd->pst_state != XMON_PST_NONE) {
+        mprotect(g2h(addr), qemu_host_page_size, x_monitor_host_prot(addr));
+        pd->pst_state = XMON_PST_NONE;
+    }
+}
+
+static void x_monitor_fork_reset_level(void **lp, int level,
+                                       target_ulong index)
+{
+    int i;
+
+    if (*lp == NULL) {
+        return;
+    }
+    if (level == 0) {
+        XMonitorPage *pd = *lp;
+
+        for (i = 0; i < XMON_L2_SIZE; i++) {
+            target_ulong page = (index << XMON_L2_BITS) | i;
+
+            x_monitor_fork_reset_page(pd + i, page << TARGET_PAGE_BITS);
+        }
+    } else {
+        void **p = *lp;
+
+        for (i = 0; i < XMON_L2_SIZE; i++) {
+            x_monitor_fork_reset_level(p + i, level - 1,
+                                       (index << XMON_L2_BITS) | i);
+        }
+    }
+}
+
+void x_monitor_fork_end(int child)
+{
+    XMonitorNode *self, *p, *next;
+    int i;
+
+    if (!child) {
+        qemu_mutex_unlock(&x_mon_mutex);
+        pthread_mutex_unlock(&g_sc_lock);
+        return;
+    }
+
+    qemu_mutex_init(&x_mon_mutex);
+    pthread_mutex_init(&g_sc_lock, NULL);
+    if (x_mon_uffd >= 0) {
+        close(x_mon_uffd);
+        x_mon_uffd = -1;
+    }
+
+    for (i = 0; i < XMON_L1_SIZE; i++) {
+        x_monitor_fork_reset_level(x_mon_l1_map + i, XMON_L2_LEVELS, i);
+    }
+    x_mon_nr_unprotect = 0;
+
+    /*
+     * Only the forking thread is left.  Nobody else can reach the nodes
+     * of the others, so they are freed right away.  The child starts
+     * with no reservation and fresh statistics.
+     */
+    self = ((TaskState *)thread_cpu->opaque)->x_monitor_node;
+    QLIST_FOREACH_SAFE(p, &x_mon_threads, thread_next, next) {
+        if (p != self) {
+            QLIST_REMOVE(p, thread_next);
+            qemu_vfree(p);
+        }
+    }
+    x_mon_nr_threads = 1;
+    self->exclusive_addr = 0;
+    self->page = NULL;
+    memset(&self->stats, 0, sizeof(self->stats));
+    memset(&x_mon_uffd_stats, 0, sizeof(x_mon_uffd_stats));
+    g_array_set_size(x_mon_exited, 0);
+    x_mon_start_ns = get_clock();
+    x_mon_multi_ns = 0;
+
+    /* A new userfaultfd and fault thread, if the parent had them.  */
+    x_monitor_wp_init();
+}
+
+void x_monitor_init(void)
+{
+    qemu_mutex_init(&x_mon_mutex);
+    x_mon_hot_sites = g_hash_table_new(NULL, NULL);
+    x_mon_exited = g_array_new(false, false, sizeof(XMonitorExited));
+    x_mon_start_ns = get_clock();
+#ifdef CONFIG_RTM_OPT
+    llsc_host_rtm = x_monitor_host_has_rtm();
+#endif
+}
@@ -0,0 +1,336 @@
+/*
+ * Exclusive monitor for ABA-safe LL/SC emulation
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef LINUX_USER_X_MONITOR_H
+#define LINUX_USER_X_MONITOR_H
+
+#include "qemu/queue.h"
+#include "qemu/rcu.h"
+#include "qemu/thread.h"
+
+/*
+ * The monitor is indexed by guest page.  Each page that has ever been the
+ * target of a load-exclusive owns an XMonitorPage entry in a lazily
+ * allocated radix table (same layout as the l1_map in translate-all.c),
+ * and every thread holding a reservation on that page is linked on the
+ * entry's list.  Each entry has its own lock and sits on its own cache
+ * line, so LL/SC pairs on different pages never share state.
+ */
+typedef struct XMonitorPage XMonitorPage;
+
+/*
+ * LL/SC statistics, collected while -llsc-stats is given.  Every thread
+ * counts into the block embedded in its own monitor node, so counting
+ * needs no atomics and shares no cache line; the blocks are only summed
+ * up for the report at exit.
+ */
+typedef enum LLSCStat {
+    LLSC_STAT_LL,
+    LLSC_STAT_SC,
+    /* store-conditional outcomes; each SC counts exactly one of these */
+    LLSC_STAT_SC_OK,
+    LLSC_STAT_SC_FAIL_ADDR,     /* not the address of the load-exclusive */
+    LLSC_STAT_SC_FAIL_VALUE,    /* memory no longer holds the loaded value */
+    LLSC_STAT_SC_FAIL_LOST,     /* the monitor broke the reservation */
+    LLSC_STAT_PST_FAULT,
+    LLSC_STAT_PST_EMULATED,     /* faulting stores done without unprotecting */
+    LLSC_STAT_PST_UNPROTECT,    /* idle pages unprotected without a fault */
+    LLSC_STAT_MPROTECT,
+    LLSC_STAT_UFFD_WP,          /* userfaultfd write-protect calls */
+    LLSC_STAT_SC_LOCK_NS,       /* time g_sc_lock was held */
+    LLSC_STAT__MAX,
+} LLSCStat;
+
+typedef struct LLSCStats {
+    uint64_t count[LLSC_STAT__MAX];
+} QEMU_ALIGNED(64) LLSCStats;
+
+typedef struct XMonitorNode {
+    /* freed through call_rcu, see x_monitor_unregister_thread */
+    struct rcu_head rcu;
+    int tid;
+    /* reserved guest address, 0 when no reservation is held */
+    target_ulong exclusive_addr;
+    /* page entry this node is linked on; only changed by the owner */
+    XMonitorPage *page;
+    QLIST_ENTRY(XMonitorNode) page_next;
+    QLIST_ENTRY(XMonitorNode) thread_next;
+    LLSCStats stats;
+} QEMU_ALIGNED(64) XMonitorNode; /* avoid false sharing among threads */
+
+struct XMonitorPage {
+    QemuSpin lock;
+    QLIST_HEAD(, XMonitorNode) nodes;
+    /* number of linked nodes holding a live reservation */
+    int nr_reserved;
+    /*
+     * XMON_LINE_BITS lines of the page that may hold a reservation; a
+     * superset, as a store-conditional does not clear its line
+     */
+    uint64_t reserved_lines;
+    /*
+     * XMonitorPSTState of the host page, kept in the entry of its first
+     * guest page only
+     */
+    int pst_state;
+    /* the host page is write-protected through the userfaultfd */
+    bool pst_uffd;
+} QEMU_ALIGNED(64);
+
+/* PST tracks reservations by 1/64 of a page, 64 bytes for 4K pages.  */
+#define XMON_LINE_BITS MAX(TARGET_PAGE_BITS - 6, 6)
+
+typedef enum XMonitorPSTState {
+    /* the host page has the protection its guest page flags ask for */
+    XMON_PST_NONE,
+    /* write-protected for the reservations on it */
+    XMON_PST_PROTECTED,
+    /* being protected, unprotected or moved; faults on it are retried */
+    XMON_PST_BUSY,
+} XMonitorPSTState;
+
+/* LL/SC emulation scheme, selected with -llsc.  */
+typedef enum LLSCScheme {
+    /* plain cmpxchg on the remembered value, not ABA-safe */
+    LLSC_CMPXCHG,
+    /* as LLSC_EXCP, and every store tags the hash entry of its address */
+    LLSC_HST,
+    /* page-protection store test on every reservation */
+    LLSC_PST,
+    /* exclusives trap to cpu_loop, which checks the monitor reservation */
+    LLSC_EXCP,
+    /*
+     * no monitor while single-threaded; plain cmpxchg for load-exclusive
+     * sites that have not seen contention, PST for those that have
+     */
+    LLSC_HYBRID,
+} LLSCScheme;
+
+/*
+ * The schemes the target's translator implements, and its default.
+ * hst, excp and hybrid need translator support that only Arm has; the
+ * AArch64 exclusives fall back to cmpxchg under hst and excp.  The
+ * other targets keep cmpxchg unless PST is asked for.
+ */
+#if defined(TARGET_ARM)
+#define LLSC_TARGET_SCHEMES \
+    ((1 << LLSC_CMPXCHG) | (1 << LLSC_HST) | (1 << LLSC_PST) | \
+     (1 << LLSC_EXCP) | (1 << LLSC_HYBRID))
+#define LLSC_TARGET_DEFAULT LLSC_PST
+#elif defined(TARGET_RISCV) || defined(TARGET_MIPS) || defined(TARGET_PPC)
+#define LLSC_TARGET_SCHEMES ((1 << LLSC_CMPXCHG) | (1 << LLSC_PST))
+#define LLSC_TARGET_DEFAULT LLSC_CMPXCHG
+#else
+#define LLSC_TARGET_SCHEMES (1 << LLSC_CMPXCHG)
+#define LLSC_TARGET_DEFAULT LLSC_CMPXCHG
+#endif
+
+extern LLSCScheme llsc_scheme;
+
+/* Whether reservations are tracked by the PST monitor.  */
+static inline bool llsc_uses_pst(void)
+{
+    return llsc_scheme == LLSC_PST || llsc_scheme == LLSC_HYBRID;
+}
+
+/* A faulting host store, decoded by the SIGSEGV handler.  */
+typedef struct XMonitorStore {
+    /* guest address of its first byte */
+    target_ulong addr;
+    /* the bytes to store, in host order */
+    uint64_t val;
+    int size;
+} XMonitorStore;
+
+typedef enum XMonitorFault {
+    /* not a PST fault, for cpu_signal_handler */
+    XMON_FAULT_FOREIGN,
+    /* restart the access */
+    XMON_FAULT_RETRY,
+    /* the store was done, skip the instruction */
+    XMON_FAULT_EMULATED,
+} XMonitorFault;
+
+/* How PST write-protects pages, selected with -llsc-wp.  */
+typedef enum LLSCWPBackend {
+    /* mprotect, conflicting stores raise SIGSEGV */
+    LLSC_WP_MPROTECT,
+    /*
+     * userfaultfd write protection, conflicting stores are resolved by a
+     * fault thread; pages it cannot handle still use mprotect
+     */
+    LLSC_WP_UFFD,
+} LLSCWPBackend;
+
+/* Reset to LLSC_WP_MPROTECT by x_monitor_wp_init() without host support.  */
+extern LLSCWPBackend llsc_wp_backend;
+
+/* Whether exclusives are emulated in cpu_loop (EXCP_LDREX/EXCP_STREX).  */
+static inline bool llsc_uses_excp(void)
+{
+    return llsc_scheme == LLSC_EXCP || llsc_scheme == LLSC_HST;
+}
+
+/*
+ * Hash store test.  Every guest store tags the entry of the word it writes
+ * with the thread id, and a store-exclusive only succeeds if the entry of
+ * its word still holds its own id.  The table lives in host memory outside
+ * the guest address space and holds 1 << llsc_hash_bits entries.
+ */
+typedef enum LLSCHashFn {
+    /* low bits of the word address */
+    LLSC_HASH_WORD,
+    /* multiplicative hash of the word address, spreads strided data */
+    LLSC_HASH_MUL,
+} LLSCHashFn;
+
+#define LLSC_HASH_MUL_K 0x9e3779b1u
+
+extern uint32_t *llsc_hash_table;
+extern int llsc_hash_bits;
+extern LLSCHashFn llsc_hash_fn;
+/*
+ * One byte per guest page, set once the page has been the target of a
+ * load-exclusive.  Stores to other pages cannot break a reservation and
+ * do not tag the table.
+ */
+extern uint8_t *llsc_hash_pages;
+
+void llsc_hash_init(void);
+
+/* Byte offset in llsc_hash_table of the entry for guest address ADDR.  */
+static inline uint32_t llsc_hash_offset(uint32_t addr)
+{
+    if (llsc_hash_fn == LLSC_HASH_MUL) {
+        return ((addr >> 2) * LLSC_HASH_MUL_K) >> (32 - llsc_hash_bits) << 2;
+    }
+    return addr & ((4u << llsc_hash_bits) - 4);
+}
+
+static inline uint32_t *llsc_hash_entry(uint32_t addr)
+{
+    return (uint32_t *)((char *)llsc_hash_table + llsc_hash_offset(addr));
+}
+
+static inline void llsc_hash_mark_page(uint32_t addr)
+{
+    atomic_set(&llsc_hash_pages[addr >> TARGET_PAGE_BITS], 1);
+}
+
+/*
+ * Store-conditional as an Intel RTM transaction, selected with -llsc-rtm.
+ * The transaction re-checks the reservation and does the store, so it
+ * needs neither a lock nor a remap; when it aborts the caller falls back
+ * to its lock-based path.
+ */
+typedef enum LLSCRTMMode {
+    /* use RTM if the host supports it */
+    LLSC_RTM_AUTO,
+    /* never use RTM */
+    LLSC_RTM_OFF,
+    /* treat every transaction as aborted, to test the fallback anywhere */
+    LLSC_RTM_ABORT,
+} LLSCRTMMode;
+
+typedef enum XMonitorRTMResult {
+    /* the store was done */
+    XMON_RTM_STORED,
+    /* the reservation was lost or memory changed */
+    XMON_RTM_FAILED,
+    /* the transaction aborted, no verdict */
+    XMON_RTM_FALLBACK,
+} XMonitorRTMResult;
+
+extern LLSCRTMMode llsc_rtm_mode;
+/* Set by x_monitor_init() if the host has usable RTM.  */
+extern bool llsc_host_rtm;
+
+static inline bool llsc_uses_rtm(void)
+{
+    return llsc_rtm_mode == LLSC_RTM_ABORT ||
+           (llsc_rtm_mode == LLSC_RTM_AUTO && llsc_host_rtm);
+}
+
+XMonitorRTMResult x_monitor_rtm_sc(void *p_node, target_ulong addr,
+                                   void *host, int len,
+                                   const void *cmpv, const void *newv,
+                                   uint32_t *tag, uint32_t *tag_hi);
+
+/*
+ * Serialises PST reservations and the lock-based store-conditional.  The
+ * fault handler does not take it.
+ */
+extern pthread_mutex_t g_sc_lock;
+
+void x_monitor_sc_lock(void);
+void x_monitor_sc_unlock(void);
+
+/* Path of the -llsc-stats report, "-" for stderr; NULL if disabled.  */
+extern const char *llsc_stats_path;
+/* The calling thread's statistics, NULL unless enabled.  */
+extern __thread LLSCStats *llsc_thread_stats;
+
+static inline void llsc_stat_add(LLSCStat stat, uint64_t n)
+{
+    LLSCStats *s = llsc_thread_stats;
+
+    if (unlikely(s)) {
+        /* Only the owner writes; the report may read concurrently.  */
+        atomic_set__nocheck(&s->count[stat], s->count[stat] + n);
+    }
+}
+
+static inline void llsc_stat_inc(LLSCStat stat)
+{
+    llsc_stat_add(stat, 1);
+}
+
+/* Count a store-conditional with OUTCOME, one of LLSC_STAT_SC_*.  */
+static inline void llsc_stat_sc(LLSCStat outcome)
+{
+    llsc_stat_inc(LLSC_STAT_SC);
+    llsc_stat_inc(outcome);
+}
+
+void x_monitor_stats_report(void);
+
+void x_monitor_init(void);
+void x_monitor_wp_init(void);
+void x_monitor_fork_start(void);
+void x_monitor_fork_end(int child);
+void *x_monitor_register_thread(int tid);
+int x_monitor_unregister_thread(int tid);
+int x_monitor_set_exclusive_addr(void *p_node, target_ulong addr);
+int x_monitor_check_exclusive(void *p_node, target_ulong addr);
+void x_monitor_clear_exclusive(void *p_node);
+int x_monitor_check_and_clean(int tid, target_ulong addr);
+XMonitorPage *x_monitor_page_lock(target_ulong addr);
+void x_monitor_page_unlock(XMonitorPage *pd);
+void x_monitor_clean_locked(XMonitorPage *pd);
+void x_monitor_pst_protect(target_ulong addr);
+XMonitorFault x_monitor_pst_fault(target_ulong addr, bool is_write,
+                                  const XMonitorStore *st);
+int x_monitor_pst_hold(target_ulong addr);
+void x_monitor_pst_release(target_ulong addr, int state);
+void x_monitor_pst_defer(target_ulong addr);
+void x_monitor_pst_flush(void);
+void x_monitor_pst_forget(target_ulong start, target_ulong end);
+bool x_monitor_site_is_hot(target_ulong pc);
+void x_monitor_site_contended(target_ulong pc);
+void x_monitor_show(const char *info);
+
+#endif
@@ -619,8 +619,12 @@ typedef struct CPUARMState {
     uint64_t exclusive_high;
     uint64_t exclusive_test;
     uint32_t exclusive_info;
-	uint64_t exclusive_node;
 	int exclusive_tid;
+    /* hybrid LL/SC: whether the reservation is monitored, and its LL pc */
+    uint32_t exclusive_pst;
+    uint64_t exclusive_pc;
+    /* hst: target of tags for pages that were never reserved */
+    uint32_t exclusive_hash_sink;
 
     /* iwMMXt coprocessor state.  */
     struct {
@@ -25,6 +25,10 @@
 #include "internals.h"
 #include "exec/exec-all.h"
 #include "exec/cpu_ldst.h"
+#ifdef CONFIG_USER_ONLY
+#include "qemu.h"
+#include "x-monitor.h"
+#endif
 
 #define SIGNBIT (uint32_t)0x80000000
 #define SIGNBIT64 ((uint64_t)1 << 63)
@@ -1003,93 +1007,8 @@ void HELPER(dc_zva)(CPUARMState *env, uint64_t vaddr_in)
 #endif
 }
 
-extern int ldex_count;
-extern long long llsc_single;
-extern long long llsc_multi;
-extern int is_multi;
-void HELPER(offload_load_exclusive_count)(uint32_t addr)
-{
-	if (!is_multi)
-		__sync_fetch_and_add(&llsc_single, 1);
-	else
-		__sync_fetch_and_add(&llsc_multi, 1);
-
-    //fprintf(stderr, "helper_offload_load_exclusive\taddr %p, value %p\n", addr, *(int*)(g2h(addr)));
-}
-
-void HELPER(offload_store_exclusive_count)(uint32_t addr)
-{
-    //extern int stex_count;
-	//__sync_fetch_and_add(&stex_count, 1);
-}
-
-void HELPER(print_aa32_addr)(uint32_t addr)
+/* An unmonitored store-exclusive failed: move its site over to PST.  */
+void HELPER(llsc_contended)(CPUARMState *env)
 {
-    fprintf(stderr, "[print_aa32_addr]\taa32 addr = %x\n", addr);
-}
-
-extern int x_monitor_set_exclusive_addr(void* p_node, uint32_t addr);
-extern int target_mprotect(abi_ulong, abi_ulong, int);
-
-extern int x_monitor_check_exclusive(void* p_node, uint32_t addr);
-extern int x_monitor_check_and_clean(int tid, uint32_t addr);
-extern pthread_mutex_t g_sc_lock;
-#define TO_PAGE(x) (x >> 12 << 12)
-#define PAGE_SIZE 0x1000
-
-void HELPER(pf_llsc_add)(CPUARMState *env, uint32_t addr, uint64_t node_addr)
-{
-    pthread_mutex_lock(&g_sc_lock);
-	target_ulong page_addr = addr & 0xfffff000;
-	x_monitor_set_exclusive_addr((void*)node_addr, addr);
-
-    // fprintf(stderr, "[pf_llsc_add]\ttid:%d\tpage addr = %x, addr=%x\n", env->exclusive_tid, page_addr, *(uint32_t *)(node_addr + 4));
-    target_mprotect(page_addr, 0x1000, PROT_READ);
-    pthread_mutex_unlock(&g_sc_lock);
-}
-
-
-// Handle sc succeed condition through exclusive monitor.
-uint32_t HELPER(x_monitor_sc)(CPUARMState *env, target_ulong addr, uint32_t cmpv, uint32_t newv)
-{
-	fprintf(stderr, "[x_monitor_sc]\ttid:%d\thello! addr %x, cmpv %x, newv %x\n", 
-					env->exclusive_tid, addr, cmpv, newv);
-
-	uint32_t *haddr = (uint32_t*)g2h(addr);
-	uint32_t curv = *haddr;
-
-	//TODO: mov curv comparing to IR
-	if (curv != cmpv) {
-        fprintf(stderr, "[x_monitor_sc]\tthread %d strex fail! addr: %x\tcurval %x, cmpv %x, exclusive mark lost.\n", env->exclusive_tid, addr, curv, cmpv);
-        return curv;
-    }
-
-	pthread_mutex_lock(&g_sc_lock);
-    
-    //x_monitor check
-    if (x_monitor_check_exclusive((void*)env->exclusive_node, addr) != 1) {
-        fprintf(stderr, "[x_monitor_sc]\tthread %d strex fail! addr: %x\tcurval %x, cmpv %x, exclusive mark lost.\n", env->exclusive_tid, addr, curv, cmpv);
-        pthread_mutex_unlock(&g_sc_lock);
-        return cmpv + 1;
-	}
-    x_monitor_check_and_clean(env->exclusive_tid, addr);
-    //x_monitor clean
-    //(x_node*)(env->exclusive_node)->exclusive_addr = 0;
-
-    //map old page to new address
-    void *pold, *pnew;
-	pold = (void*)TO_PAGE((uint64_t)haddr);
-	pnew = mmap(0, PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
-    assert(((long)mremap(pold, PAGE_SIZE, PAGE_SIZE, MREMAP_FIXED | MREMAP_MAYMOVE, pnew)) != -1);
-
-    //store value to new page
-	mprotect(pnew, PAGE_SIZE, PROT_READ | PROT_WRITE);
-    uint32_t ret = __sync_val_compare_and_swap(haddr - (uint32_t *)pold + (uint32_t *)pnew, cmpv, newv);
-
-    //map new address returnn old
-	assert ((mremap(pnew, PAGE_SIZE, PAGE_SIZE, MREMAP_FIXED | MREMAP_MAYMOVE, pold)) == pold);
-	pthread_mutex_unlock(&g_sc_lock);
-	//fprintf(stderr, "[x_monitor_sc]\tcmpxchged! thread %d strex! retv %x\n", env->exclusive_tid, ret);
-	return ret;
-
+    x_monitor_site_contended(env->exclusive_pc);
 }
@@ -39,6 +39,10 @@
 #include "translate-a64.h"
 #include "qemu/atomic128.h"
 
+#ifdef CONFIG_USER_ONLY
+#include "x-monitor.h"
+#endif
+
 static TCGv_i64 cpu_X[32];
 static TCGv_i64 cpu_pc;
 
@@ -1467,6 +1471,9 @@ static void handle_hint(DisasContext *s, uint32_t insn,
 static void gen_clrex(DisasContext *s, uint32_t insn)
 {
     tcg_gen_movi_i64(cpu_exclusive_addr, -1);
+    if (llsc_uses_pst()) {
+        tcg_gen_llsc_clrex();
+    }
 }
 
 /* CLREX, DSB, DMB, ISB */
@@ -2203,6 +2210,13 @@ static void gen_load_exclusive(DisasContext *s, int rt, int rt2,
     TCGMemOp memop = s->be_data;
 
     g_assert(size <= 3);
+    tcg_gen_llsc_profile_ll(s->base.pc_next);
+    if (llsc_uses_pst() && arm_gen_llsc_monitored(s)) {
+        tcg_gen_llsc_reserve(addr);
+    } else {
+        tcg_gen_llsc_stat(LLSC_STAT_LL);
+    }
+
     if (is_pair) {
         g_assert(size >= 2);
         if (size == 2) {
@@ -2239,28 +2253,11 @@ static void gen_load_exclusive(DisasContext *s, int rt, int rt2,
     tcg_gen_mov_i64(cpu_exclusive_addr, addr);
 }
 
-static void gen_store_exclusive(DisasContext *s, int rd, int rt, int rt2,
-                                TCGv_i64 addr, int size, int is_pair)
+/* Store-exclusive as a cmpxchg on the value seen by the load-exclusive.  */
+static void gen_store_exclusive_cmpxchg(DisasContext *s, TCGv_i64 tmp,
+                                        int rt, int rt2, int size,
+                                        int is_pair)
 {
-    /* if (env->exclusive_addr == addr && env->exclusive_val == [addr]
-     *     && (!is_pair || env->exclusive_high == [addr + datasize])) {
-     *     [addr] = {Rt};
-     *     if (is_pair) {
-     *         [addr + datasize] = {Rt2};
-     *     }
-     *     {Rd} = 0;
-     * } else {
-     *     {Rd} = 1;
-     * }
-     * env->exclusive_addr = -1;
-     */
-    TCGLabel *fail_label = gen_new_label();
-    TCGLabel *done_label = gen_new_label();
-    TCGv_i64 tmp;
-
-    tcg_gen_brcond_i64(TCG_COND_NE, addr, cpu_exclusive_addr, fail_label);
-
-    tmp = tcg_temp_new_i64();
     if (is_pair) {
         if (size == 2) {
             if (s->be_data == MO_LE) {
@@ -2301,13 +2298,90 @@ static void gen_store_exclusive(DisasContext *s, int rd, int rt, int rt2,
                                    size | MO_ALIGN | s->be_data);
         tcg_gen_setcond_i64(TCG_COND_NE, tmp, tmp, cpu_exclusive_val);
     }
+    tcg_gen_llsc_stat_sc(tmp);
+}
+
+/*
+ * Store-exclusive through the PST monitor, which checks the reservation
+ * as well as the value.
+ */
+static void gen_store_exclusive_pst(DisasContext *s, TCGv_i64 tmp,
+                                    int rt, int rt2, int size, int is_pair)
+{
+    if (is_pair && size == 3) {
+        tcg_gen_llsc_store_cond_pair_i64(tmp, cpu_exclusive_addr,
+                                         cpu_exclusive_val, cpu_exclusive_high,
+                                         cpu_reg(s, rt), cpu_reg(s, rt2),
+                                         MO_64 | s->be_data);
+    } else if (is_pair) {
+        if (s->be_data == MO_LE) {
+            tcg_gen_concat32_i64(tmp, cpu_reg(s, rt), cpu_reg(s, rt2));
+        } else {
+            tcg_gen_concat32_i64(tmp, cpu_reg(s, rt2), cpu_reg(s, rt));
+        }
+        tcg_gen_llsc_store_cond_i64(tmp, cpu_exclusive_addr,
+                                    cpu_exclusive_val, tmp,
+                                    MO_64 | s->be_data);
+    } else {
+        tcg_gen_llsc_store_cond_i64(tmp, cpu_exclusive_addr,
+                                    cpu_exclusive_val, cpu_reg(s, rt),
+                                    size | s->be_data);
+    }
+}
+
+static void gen_store_exclusive(DisasContext *s, int rd, int rt, int rt2,
+                                TCGv_i64 addr, int size, int is_pair)
+{
+    /* if (env->exclusive_addr == addr && env->exclusive_val == [addr]
+     *     && (!is_pair || env->exclusive_high == [addr + datasize])) {
+     *     [addr] = {Rt};
+     *     if (is_pair) {
+     *         [addr + datasize] = {Rt2};
+     *     }
+     *     {Rd} = 0;
+     * } else {
+     *     {Rd} = 1;
+     * }
+     * env->exclusive_addr = -1;
+     */
+    TCGLabel *fail_label = gen_new_label();
+    TCGLabel *done_label = gen_new_label();
+    TCGv_i64 tmp;
+
+    tcg_gen_brcond_i64(TCG_COND_NE, addr, cpu_exclusive_addr, fail_label);
+
+    tmp = tcg_temp_new_i64();
+    if (llsc_scheme == LLSC_HYBRID) {
+        TCGLabel *pst_label = gen_new_label();
+
+        /* Reservations taken without the monitor use a plain cmpxchg.  */
+        tcg_gen_ld32u_i64(tmp, cpu_env, offsetof(CPUARMState, exclusive_pst));
+        tcg_gen_brcondi_i64(TCG_COND_NE, tmp, 0, pst_label);
+        gen_store_exclusive_cmpxchg(s, tmp, rt, rt2, size, is_pair);
+        tcg_gen_mov_i64(cpu_reg(s, rd), tmp);
+        if (tb_cflags(s->base.tb) & CF_PARALLEL) {
+            /* Another thread got in between: promote the site to PST.  */
+            tcg_gen_brcondi_i64(TCG_COND_EQ, tmp, 0, done_label);
+            gen_helper_llsc_contended(cpu_env);
+        }
+        tcg_gen_br(done_label);
+        gen_set_label(pst_label);
+    }
+
+    if (llsc_uses_pst()) {
+        gen_store_exclusive_pst(s, tmp, rt, rt2, size, is_pair);
+    } else {
+        gen_store_exclusive_cmpxchg(s, tmp, rt, rt2, size, is_pair);
+    }
     tcg_gen_mov_i64(cpu_reg(s, rd), tmp);
     tcg_temp_free_i64(tmp);
     tcg_gen_br(done_label);
 
     gen_set_label(fail_label);
+    tcg_gen_llsc_stat(LLSC_STAT_SC_FAIL_ADDR);
     tcg_gen_movi_i64(cpu_reg(s, rd), 1);
     gen_set_label(done_label);
+    tcg_gen_llsc_profile_sc(s->base.pc_next, cpu_reg(s, rd));
     tcg_gen_movi_i64(cpu_exclusive_addr, -1);
 }
 
@@ -37,11 +37,9 @@
 #include "trace-tcg.h"
 #include "exec/log.h"
 
-//#define HASH_LLSC
-#define PF_LLSC
-//#define PICO_ST_LLSC
-//#define GEN_SC_EXCP			/* gen EXCEPTION on STREX */
-//#define GEN_LL_EXCP		/* gen EXCEPTION on LDREX */
+#ifdef CONFIG_USER_ONLY
+#include "x-monitor.h"
+#endif
 
 #define ENABLE_ARCH_4T    arm_dc_feature(s, ARM_FEATURE_V4T)
 #define ENABLE_ARCH_5     arm_dc_feature(s, ARM_FEATURE_V5)
@@ -71,13 +69,8 @@ TCGv_i32 cpu_CF, cpu_NF, cpu_VF, cpu_ZF;
 TCGv_i64 cpu_exclusive_addr;
 TCGv_i64 cpu_exclusive_val;
 static TCGv_i32 cpu_exclusive_tid;
-#ifdef GEN_SC_EXCP
 static TCGv_i64 cpu_exclusive_test;
 static TCGv_i32 cpu_exclusive_info;
-#endif
-#ifdef PF_LLSC
-static TCGv_i64 cpu_exclusive_node;
-#endif
 
 #include "exec/gen-icount.h"
 
@@ -112,16 +105,10 @@ void arm_translate_init(void)
         offsetof(CPUARMState, exclusive_val), "exclusive_val");
     cpu_exclusive_tid = tcg_global_mem_new_i32(cpu_env,
         offsetof(CPUARMState, exclusive_tid), "exclusive_tid");
-#ifdef GEN_SC_EXCP
     cpu_exclusive_test = tcg_global_mem_new_i64(cpu_env,
         offsetof(CPUARMState, exclusive_test), "exclusive_test");
     cpu_exclusive_info = tcg_global_mem_new_i32(cpu_env,
         offsetof(CPUARMState, exclusive_info), "exclusive_info");
-#endif
-#ifdef PF_LLSC
-    cpu_exclusive_node = tcg_global_mem_new_i64(cpu_env,
-        offsetof(CPUARMState, exclusive_node), "exclusive_node");
-#endif
 
     a64_translate_init();
 }
@@ -1131,6 +1118,61 @@ static void gen_aa32_ld_i32(DisasContext *s, TCGv_i32 val, TCGv_i32 a32,
     tcg_temp_free(addr);
 }
 
+/*
+ * Hash store test: tag the hash table entry of the word at A32 with our
+ * thread id.  The table is in host memory, so it is written with a plain
+ * host store rather than a guest memory access.  Stores to pages that
+ * were never the target of a load-exclusive write a per-thread sink in
+ * CPUARMState instead, which keeps them off the shared table without
+ * ending the basic block.
+ *
+ * Sinking is safe because pages are only marked by do_ldrex under
+ * start_exclusive(): no other thread is inside a TB at that point, so a
+ * store either completed before the mark, and before the value was
+ * loaded, or reads the mark and tags the table.
+ */
+static void gen_llsc_hash_tag(DisasContext *s, TCGv_i32 a32)
+{
+    TCGv_i32 off;
+    TCGv_ptr ptr, flag, sink, zero;
+
+    if (s->sp_based) {
+        return;
+    }
+
+    off = tcg_temp_new_i32();
+    ptr = tcg_temp_new_ptr();
+    flag = tcg_temp_new_ptr();
+    sink = tcg_temp_new_ptr();
+
+    tcg_gen_shri_i32(off, a32, TARGET_PAGE_BITS);
+    tcg_gen_ext_i32_ptr(ptr, off);
+    tcg_gen_addi_ptr(ptr, ptr, (intptr_t)llsc_hash_pages);
+    tcg_gen_ld8u_i32(off, ptr, 0);
+    tcg_gen_ext_i32_ptr(flag, off);
+
+    if (llsc_hash_fn == LLSC_HASH_MUL) {
+        tcg_gen_shri_i32(off, a32, 2);
+        tcg_gen_muli_i32(off, off, LLSC_HASH_MUL_K);
+        tcg_gen_shri_i32(off, off, 32 - llsc_hash_bits);
+        tcg_gen_shli_i32(off, off, 2);
+    } else {
+        tcg_gen_andi_i32(off, a32, (4u << llsc_hash_bits) - 4);
+    }
+    tcg_gen_ext_i32_ptr(ptr, off);
+    tcg_gen_addi_ptr(ptr, ptr, (intptr_t)llsc_hash_table);
+    tcg_gen_addi_ptr(sink, cpu_env,
+                     offsetof(CPUARMState, exclusive_hash_sink));
+    zero = tcg_const_ptr(0);
+    tcg_gen_movcond_ptr(TCG_COND_NE, ptr, flag, zero, ptr, sink);
+    tcg_gen_st_i32(cpu_exclusive_tid, ptr, 0);
+    tcg_temp_free_ptr(zero);
+    tcg_temp_free_ptr(sink);
+    tcg_temp_free_ptr(flag);
+    tcg_temp_free_ptr(ptr);
+    tcg_temp_free_i32(off);
+}
+
 static void gen_aa32_st_i32(DisasContext *s, TCGv_i32 val, TCGv_i32 a32,
                             int index, TCGMemOp opc)
 {
@@ -1143,20 +1185,9 @@ static void gen_aa32_st_i32(DisasContext *s, TCGv_i32 val, TCGv_i32 a32,
 
     addr = gen_aa32_addr(s, a32, opc);
 	/* A Hash approach to avoid ABA problem. */
-#ifdef HASH_LLSC
-    TCGv_i32 mask1 = tcg_const_i32(0x0fffffff);
-    TCGv_i32 mask2 = tcg_const_i32(0xa0000000);
-    TCGv_i32 hash_addr = tcg_temp_new_i32();
-
-    //tcg_gen_ldex_count(addr);
-    tcg_gen_and_i32(hash_addr, addr, mask1);
-    tcg_gen_or_i32(hash_addr, hash_addr, mask2);
-    //tcg_gen_ldex_count(hash_addr);
-    tcg_gen_qemu_st_i32(cpu_exclusive_tid, hash_addr, index, opc);
-    tcg_temp_free(mask1);
-    tcg_temp_free(mask2);
-    tcg_temp_free(hash_addr);
-#endif /* HASH_LLSC */
+    if (llsc_scheme == LLSC_HST) {
+        gen_llsc_hash_tag(s, a32);
+    }
     tcg_gen_qemu_st_i32(val, addr, index, opc);
     tcg_temp_free(addr);
 }
@@ -1219,6 +1250,16 @@ static void gen_aa32_st_i64(DisasContext *s, TCGv_i64 val, TCGv_i32 a32,
 {
     TCGv addr = gen_aa32_addr(s, a32, opc);
 
+    if (llsc_scheme == LLSC_HST) {
+        TCGv_i32 hi = tcg_temp_new_i32();
+
+        /* A doubleword store covers two words.  */
+        gen_llsc_hash_tag(s, a32);
+        tcg_gen_addi_i32(hi, a32, 4);
+        gen_llsc_hash_tag(s, hi);
+        tcg_temp_free_i32(hi);
+    }
+
     /* Not needed for user-mode BE32, where we use MO_BE instead.  */
     if (!IS_USER_ONLY && s->sctlr_b) {
         TCGv_i64 tmp = tcg_temp_new_i64();
@@ -7471,34 +7512,67 @@ static void gen_logicq_cc(TCGv_i32 lo, TCGv_i32 hi)
    the architecturally mandated semantics, and avoids having to monitor
    regular stores.  The compare vs the remembered value is done during
    the cmpxchg operation, but we must compare the addresses manually.  */
-#ifdef GEN_LL_EXCP
-static void gen_load_exclusive(DisasContext *s, int rt, int rt2,
-                               TCGv_i32 addr, int size)
+static void gen_load_exclusive_excp(DisasContext *s, int rt, int rt2,
+                                    TCGv_i32 addr, int size)
 {
-    if (size == 3) {
-		fprintf(stderr, "![gen_load_exclusive] size ==3: function not implemented!\n");
-		exit(2);
-	}
-	tcg_gen_extu_i32_i64(cpu_exclusive_addr, addr);
-	tcg_gen_movi_i32(cpu_exclusive_info, rt);
+    tcg_gen_extu_i32_i64(cpu_exclusive_addr, addr);
+    tcg_gen_movi_i32(cpu_exclusive_info, rt | (rt2 << 4) | (size << 8));
 	gen_exception_internal_insn(s, 4, EXCP_LDREX);
 }
-#else
+
+/*
+ * Whether the load-exclusive being translated takes a PST reservation.
+ * Under the hybrid scheme this is decided per site: never while the guest
+ * is single-threaded, otherwise only once the site has seen contention.
+ * The choice is recorded for the matching store-exclusive, which usually
+ * sits in another TB.
+ */
+bool arm_gen_llsc_monitored(DisasContext *s)
+{
+    TCGv_i32 tmp;
+    TCGv_i64 pc;
+    bool pst;
+
+    if (llsc_scheme != LLSC_HYBRID) {
+        return true;
+    }
+
+    pst = (tb_cflags(s->base.tb) & CF_PARALLEL) &&
+          x_monitor_site_is_hot(s->base.pc_next);
+    tmp = tcg_const_i32(pst);
+    tcg_gen_st_i32(tmp, cpu_env, offsetof(CPUARMState, exclusive_pst));
+    tcg_temp_free_i32(tmp);
+    pc = tcg_const_i64(s->base.pc_next);
+    tcg_gen_st_i64(pc, cpu_env, offsetof(CPUARMState, exclusive_pc));
+    tcg_temp_free_i64(pc);
+    return pst;
+}
+
 static void gen_load_exclusive(DisasContext *s, int rt, int rt2,
                                TCGv_i32 addr, int size)
 {
-    TCGv_i32 tmp = tcg_temp_new_i32();
+    TCGv_i32 tmp;
     TCGMemOp opc = size | MO_ALIGN | s->be_data;
-	//tcg_gen_stex_count(addr);
-	//tcg_gen_ldex_count(addr);
+
+    if (llsc_uses_excp()) {
+        gen_load_exclusive_excp(s, rt, rt2, addr, size);
+        return;
+    }
+
+    tmp = tcg_temp_new_i32();
     s->is_ldex = true;
-#ifdef PF_LLSC
-	gen_helper_pf_llsc_add(cpu_env, addr, cpu_exclusive_node);
-#endif
+    tcg_gen_llsc_profile_ll(s->base.pc_next);
+    if (llsc_uses_pst() && arm_gen_llsc_monitored(s)) {
+        TCGv taddr = tcg_temp_new();
+
+        tcg_gen_extu_i32_tl(taddr, addr);
+        tcg_gen_llsc_reserve(taddr);
+        tcg_temp_free(taddr);
+    } else {
+        tcg_gen_llsc_stat(LLSC_STAT_LL);
+    }
 
     if (size == 3) {
-		fprintf(stderr, "![gen_load_exclusive] size ==3: function not implemented!\n");
-		exit(2);
         TCGv_i32 tmp2 = tcg_temp_new_i32();
         TCGv_i64 t64 = tcg_temp_new_i64();
 
@@ -7534,54 +7608,40 @@ static void gen_load_exclusive(DisasContext *s, int rt, int rt2,
     store_reg(s, rt, tmp);
     tcg_gen_extu_i32_i64(cpu_exclusive_addr, addr);
 }
-#endif
 
 static void gen_clrex(DisasContext *s)
 {
     tcg_gen_movi_i64(cpu_exclusive_addr, -1);
+    if (llsc_uses_pst() || llsc_uses_excp()) {
+        tcg_gen_llsc_clrex();
+    }
 }
 
-#ifdef GEN_SC_EXCP
-static void gen_store_exclusive(DisasContext *s, int rd, int rt, int rt2,
-                                TCGv_i32 addr, int size)
+static void gen_store_exclusive_excp(DisasContext *s, int rd, int rt, int rt2,
+                                     TCGv_i32 addr, int size)
 {
     tcg_gen_extu_i32_i64(cpu_exclusive_test, addr);
     tcg_gen_movi_i32(cpu_exclusive_info,
                      size | (rd << 4) | (rt << 8) | (rt2 << 12));
     gen_exception_internal_insn(s, 4, EXCP_STREX);
 }
-#else
-static void gen_store_exclusive(DisasContext *s, int rd, int rt, int rt2,
-                                TCGv_i32 addr, int size)
+
+/*
+ * Store Rt (and Rt2 for a doubleword) at ADDR if memory still holds the
+ * value seen by the load-exclusive, and set T0 to the status.  With PST
+ * the monitor also checks the reservation.
+ */
+static void gen_store_exclusive_cas(DisasContext *s, TCGv_i32 t0, int rt,
+                                    int rt2, TCGv_i32 addr, int size, bool pst)
 {
-    TCGv_i32 t0, t1, t2;
-    TCGv_i64 extaddr;
-    TCGv taddr;
-    TCGLabel *done_label;
-    TCGLabel *fail_label;
     TCGMemOp opc = size | MO_ALIGN | s->be_data;
+    TCGv taddr = gen_aa32_addr(s, addr, opc);
+    TCGv_i64 n64 = tcg_temp_new_i64();
+    TCGv_i32 t1 = load_reg(s, rt);
 
-    /* if (env->exclusive_addr == addr && env->exclusive_val == [addr]) {
-         [addr] = {Rt};
-         {Rd} = 0;
-       } else {
-         {Rd} = 1;
-       } */
-    fail_label = gen_new_label();
-    done_label = gen_new_label();
-    extaddr = tcg_temp_new_i64();
-    tcg_gen_extu_i32_i64(extaddr, addr);
-    tcg_gen_brcond_i64(TCG_COND_NE, extaddr, cpu_exclusive_addr, fail_label);
-    tcg_temp_free_i64(extaddr);
-
-    taddr = gen_aa32_addr(s, addr, opc);
-    t0 = tcg_temp_new_i32();
-    t1 = load_reg(s, rt);
     if (size == 3) {
-        TCGv_i64 o64 = tcg_temp_new_i64();
-        TCGv_i64 n64 = tcg_temp_new_i64();
+        TCGv_i32 t2 = load_reg(s, rt2);
 
-        t2 = load_reg(s, rt2);
         /* For AArch32, architecturally the 32-bit word at the lowest
          * address is always Rt and the one at addr+4 is Rt2, even if
          * the CPU is big-endian. Since we're going to treat this as a
@@ -7597,40 +7657,86 @@ static void gen_store_exclusive(DisasContext *s, int rd, int rt, int rt2,
             tcg_gen_concat_i32_i64(n64, t1, t2);
         }
         tcg_temp_free_i32(t2);
+    } else {
+        tcg_gen_extu_i32_i64(n64, t1);
+    }
+    tcg_temp_free_i32(t1);
 
-		fprintf(stderr, "[store_exclusive]\tFunction not implemented in QEMU-ABA!\n");
-		exit(2);
-
-        tcg_gen_atomic_cmpxchg_i64(o64, taddr, cpu_exclusive_val, n64,
+    if (pst) {
+        tcg_gen_llsc_store_cond_i64(n64, taddr, cpu_exclusive_val, n64, opc);
+    } else {
+        tcg_gen_atomic_cmpxchg_i64(n64, taddr, cpu_exclusive_val, n64,
                                    get_mem_index(s), opc);
-        tcg_temp_free_i64(n64);
+        tcg_gen_setcond_i64(TCG_COND_NE, n64, n64, cpu_exclusive_val);
+        tcg_gen_llsc_stat_sc(n64);
+    }
+    tcg_gen_extrl_i64_i32(t0, n64);
+    tcg_temp_free_i64(n64);
+    tcg_temp_free(taddr);
+}
 
-        tcg_gen_setcond_i64(TCG_COND_NE, o64, o64, cpu_exclusive_val);
-        tcg_gen_extrl_i64_i32(t0, o64);
+static void gen_store_exclusive(DisasContext *s, int rd, int rt, int rt2,
+                                TCGv_i32 addr, int size)
+{
+    TCGv_i32 t0;
+    TCGv_i64 extaddr;
+    TCGLabel *done_label;
+    TCGLabel *fail_label;
 
-        tcg_temp_free_i64(o64);
-    } else {
-        t2 = tcg_temp_new_i32();
-        tcg_gen_extrl_i64_i32(t2, cpu_exclusive_val);
-	
-		// Insert helper to handle sc succeed condition through exclusive monitor.
-        tcg_gen_x_monitor_cmpxchg_i32(t0, taddr, t2, t1, get_mem_index(s), opc);
-        //tcg_gen_atomic_cmpxchg_i32(t0, taddr, t2, t1, get_mem_index(s), opc);
-        tcg_gen_setcond_i32(TCG_COND_NE, t0, t0, t2);
-        tcg_temp_free_i32(t2);
+    if (llsc_uses_excp()) {
+        gen_store_exclusive_excp(s, rd, rt, rt2, addr, size);
+        return;
     }
-    tcg_temp_free_i32(t1);
-    tcg_temp_free(taddr);
+
+    /* if (env->exclusive_addr == addr && env->exclusive_val == [addr]) {
+         [addr] = {Rt};
+         {Rd} = 0;
+       } else {
+         {Rd} = 1;
+       } */
+    fail_label = gen_new_label();
+    done_label = gen_new_label();
+    extaddr = tcg_temp_new_i64();
+    tcg_gen_extu_i32_i64(extaddr, addr);
+    tcg_gen_brcond_i64(TCG_COND_NE, extaddr, cpu_exclusive_addr, fail_label);
+    tcg_temp_free_i64(extaddr);
+
+    t0 = tcg_temp_new_i32();
+    if (llsc_scheme == LLSC_HYBRID) {
+        TCGLabel *pst_label = gen_new_label();
+
+        /* Reservations taken without the monitor use a plain cmpxchg.  */
+        tcg_gen_ld_i32(t0, cpu_env, offsetof(CPUARMState, exclusive_pst));
+        tcg_gen_brcondi_i32(TCG_COND_NE, t0, 0, pst_label);
+        gen_store_exclusive_cas(s, t0, rt, rt2, addr, size, false);
+        tcg_gen_mov_i32(cpu_R[rd], t0);
+        if (tb_cflags(s->base.tb) & CF_PARALLEL) {
+            /* Another thread got in between: promote the site to PST.  */
+            tcg_gen_brcondi_i32(TCG_COND_EQ, t0, 0, done_label);
+            gen_helper_llsc_contended(cpu_env);
+        }
+        tcg_gen_br(done_label);
+        gen_set_label(pst_label);
+    }
+
+    gen_store_exclusive_cas(s, t0, rt, rt2, addr, size, llsc_uses_pst());
     tcg_gen_mov_i32(cpu_R[rd], t0);
     tcg_temp_free_i32(t0);
     tcg_gen_br(done_label);
 
     gen_set_label(fail_label);
+    tcg_gen_llsc_stat(LLSC_STAT_SC_FAIL_ADDR);
     tcg_gen_movi_i32(cpu_R[rd], 1);
     gen_set_label(done_label);
+    if (tcg_llsc_profile_enabled()) {
+        TCGv_i64 status = tcg_temp_new_i64();
+
+        tcg_gen_extu_i32_i64(status, cpu_R[rd]);
+        tcg_gen_llsc_profile_sc(s->base.pc_next, status);
+        tcg_temp_free_i64(status);
+    }
     tcg_gen_movi_i64(cpu_exclusive_addr, -1);
 }
-#endif
 
 /* gen_srs:
  * @env: CPUARMState
@@ -7792,6 +7898,8 @@ static void disas_arm_insn(DisasContext *s, unsigned int insn)
                            default_exception_el(s));
         return;
     }
+    /* All A32 loads and stores take their base register in bits [19:16].  */
+    s->sp_based = extract32(insn, 16, 4) == 13;
     cond = insn >> 28;
     if (cond == 0xf){
         /* In ARMv3 and v4 the NV condition is UNPREDICTABLE; we
@@ -8692,6 +8800,9 @@ static void disas_arm_insn(DisasContext *s, unsigned int insn)
 
                         addr = load_reg(s, rn);
                         taddr = gen_aa32_addr(s, addr, opc);
+                        if (llsc_scheme == LLSC_HST) {
+                            gen_llsc_hash_tag(s, addr);
+                        }
                         tcg_temp_free_i32(addr);
 
                         tmp = load_reg(s, rm);
@@ -9514,6 +9625,8 @@ static void disas_thumb2_insn(DisasContext *s, uint32_t insn)
     rs = (insn >> 12) & 0xf;
     rd = (insn >> 8) & 0xf;
     rm = insn & 0xf;
+    /* All T32 loads and stores take their base register in bits [19:16].  */
+    s->sp_based = rn == 13;
     switch ((insn >> 25) & 0xf) {
     case 0: case 1: case 2: case 3:
         /* 16-bit instructions.  Should never happen.  */
@@ -11062,6 +11175,9 @@ static void disas_thumb_insn(DisasContext *s, uint32_t insn)
     TCGv_i32 tmp2;
     TCGv_i32 addr;
 
+    /* STR Rt, [SP, #imm] and PUSH */
+    s->sp_based = (insn & 0xf800) == 0x9000 || (insn & 0xfe00) == 0xb400;
+
     switch (insn >> 12) {
     case 0: case 1:
 
@@ -11974,6 +12090,7 @@ static void arm_tr_init_disas_context(DisasContextBase *dcbase, CPUState *cs)
     dc->ss_active = FIELD_EX32(tb_flags, TBFLAG_ANY, SS_ACTIVE);
     dc->pstate_ss = FIELD_EX32(tb_flags, TBFLAG_ANY, PSTATE_SS);
     dc->is_ldex = false;
+    dc->sp_based = false;
     dc->ss_same_el = false; /* Can't be true since EL_d must be AArch64 */
 
     dc->page_start = dc->base.pc_first & TARGET_PAGE_MASK;
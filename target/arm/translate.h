@@ -69,6 +69,11 @@ typedef struct DisasContext {
      * ie A64 LDX*, LDAX*, A32/T32 LDREX*, LDAEX*.
      */
     bool is_ldex;
+    /* True if the insn being translated addresses memory relative to SP;
+     * such stores are assumed not to alias a reservation of another
+     * thread and are left out of the hash store test.
+     */
+    bool sp_based;
     /* True if a single-step exception will be taken to the current EL */
     bool ss_same_el;
     /* True if v8.3-PAuth is active.  */
@@ -184,6 +189,7 @@ void arm_test_cc(DisasCompare *cmp, int cc);
 void arm_free_cc(DisasCompare *cmp);
 void arm_jump_cc(DisasCompare *cmp, TCGLabel *label);
 void arm_gen_test_cc(int cc, TCGLabel *label);
+bool arm_gen_llsc_monitored(DisasContext *s);
 
 /* Return state of Alternate Half-precision flag, caller frees result */
 static inline TCGv_i32 get_ahp_flag(void)
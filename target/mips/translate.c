@@ -3365,6 +3365,9 @@ static inline void op_ld_##insn(TCGv ret, TCGv arg1, int mem_idx,          \
 {                                                                          \
     TCGv t0 = tcg_temp_new();                                              \
     tcg_gen_mov_tl(t0, arg1);                                              \
+    if (tcg_llsc_enabled()) {                                              \
+        tcg_gen_llsc_reserve(arg1);                                        \
+    }                                                                      \
     tcg_gen_qemu_##fname(ret, arg1, ctx->mem_idx);                         \
     tcg_gen_st_tl(t0, cpu_env, offsetof(CPUMIPSState, lladdr));                \
     tcg_gen_st_tl(ret, cpu_env, offsetof(CPUMIPSState, llval));                \
@@ -3726,9 +3729,15 @@ static void gen_st_cond(DisasContext *ctx, int rt, int base, int offset,
     /* generate cmpxchg */
     val = tcg_temp_new();
     gen_load_gpr(val, rt);
-    tcg_gen_atomic_cmpxchg_tl(t0, cpu_lladdr, cpu_llval, val,
-                              eva ? MIPS_HFLAG_UM : ctx->mem_idx, tcg_mo);
-    tcg_gen_setcond_tl(TCG_COND_EQ, t0, t0, cpu_llval);
+    if (tcg_llsc_enabled()) {
+        tcg_gen_llsc_store_cond_tl(t0, cpu_lladdr, cpu_llval, val, tcg_mo);
+        /* rt is 1 on success */
+        tcg_gen_xori_tl(t0, t0, 1);
+    } else {
+        tcg_gen_atomic_cmpxchg_tl(t0, cpu_lladdr, cpu_llval, val,
+                                  eva ? MIPS_HFLAG_UM : ctx->mem_idx, tcg_mo);
+        tcg_gen_setcond_tl(TCG_COND_EQ, t0, t0, cpu_llval);
+    }
     gen_store_gpr(t0, rt);
     tcg_temp_free(val);
 
@@ -3149,6 +3149,9 @@ static void gen_load_locked(DisasContext *ctx, TCGMemOp memop)
 
     gen_set_access_type(ctx, ACCESS_RES);
     gen_addr_reg_index(ctx, t0);
+    if (tcg_llsc_enabled()) {
+        tcg_gen_llsc_reserve(t0);
+    }
     tcg_gen_qemu_ld_tl(gpr, t0, ctx->mem_idx, memop | MO_ALIGN);
     tcg_gen_mov_tl(cpu_reserve, t0);
     tcg_gen_mov_tl(cpu_reserve_val, gpr);
@@ -3402,10 +3405,16 @@ static void gen_conditional_store(DisasContext *ctx, TCGMemOp memop)
     tcg_temp_free(t0);
 
     t0 = tcg_temp_new();
-    tcg_gen_atomic_cmpxchg_tl(t0, cpu_reserve, cpu_reserve_val,
-                              cpu_gpr[reg], ctx->mem_idx,
-                              DEF_MEMOP(memop) | MO_ALIGN);
-    tcg_gen_setcond_tl(TCG_COND_EQ, t0, t0, cpu_reserve_val);
+    if (tcg_llsc_enabled()) {
+        tcg_gen_llsc_store_cond_tl(t0, cpu_reserve, cpu_reserve_val,
+                                   cpu_gpr[reg], DEF_MEMOP(memop));
+        tcg_gen_setcondi_tl(TCG_COND_EQ, t0, t0, 0);
+    } else {
+        tcg_gen_atomic_cmpxchg_tl(t0, cpu_reserve, cpu_reserve_val,
+                                  cpu_gpr[reg], ctx->mem_idx,
+                                  DEF_MEMOP(memop) | MO_ALIGN);
+        tcg_gen_setcond_tl(TCG_COND_EQ, t0, t0, cpu_reserve_val);
+    }
     tcg_gen_shli_tl(t0, t0, CRF_EQ_BIT);
     tcg_gen_or_tl(t0, t0, cpu_so);
     tcg_gen_trunc_tl_i32(cpu_crf[0], t0);
@@ -229,6 +229,14 @@ static inline void tb_target_set_jmp_target(uintptr_t tc_ptr,
 
 #define TCG_TARGET_HAS_MEMORY_BSWAP  1
 
+/* LL/SC reservation probe, see tcg_out_qemu_ll.  */
+#if defined(CONFIG_LINUX_USER) && TCG_TARGET_REG_BITS == 64 \
+    && !defined(_WIN64)
+#define TCG_TARGET_HAS_qemu_llsc     1
+#else
+#define TCG_TARGET_HAS_qemu_llsc     0
+#endif
+
 #ifdef CONFIG_SOFTMMU
 #define TCG_TARGET_NEED_LDST_LABELS
 #endif
@@ -264,6 +264,19 @@ static const char *target_parse_constraint(TCGArgConstraint *ct,
         tcg_regset_reset_reg(ct->u.regs, TCG_REG_L1);
         break;
 
+#if TCG_TARGET_HAS_qemu_llsc
+        /* qemu_ll/sc operand constraint, kept out of the helper arguments */
+    case 'C':
+        ct->ct |= TCG_CT_REG;
+        ct->u.regs = ALL_GENERAL_REGS;
+        tcg_regset_reset_reg(ct->u.regs, tcg_target_call_iarg_regs[0]);
+        tcg_regset_reset_reg(ct->u.regs, tcg_target_call_iarg_regs[1]);
+        tcg_regset_reset_reg(ct->u.regs, tcg_target_call_iarg_regs[2]);
+        tcg_regset_reset_reg(ct->u.regs, tcg_target_call_iarg_regs[3]);
+        tcg_regset_reset_reg(ct->u.regs, tcg_target_call_iarg_regs[4]);
+        break;
+#endif
+
     case 'e':
         ct->ct |= (type == TCG_TYPE_I32 ? TCG_CT_CONST : TCG_CT_CONST_S32);
         break;
@@ -2252,6 +2265,70 @@ static void tcg_out_qemu_st(TCGContext *s, const TCGArg *args, bool is64)
 #endif
 }
 
+#if TCG_TARGET_HAS_qemu_llsc
+/*
+ * Compare ADDR with the reservation of the current thread.  ZF is set if
+ * this thread still holds a reservation on ADDR.  Clobbers TCG_REG_L0.
+ */
+static void tcg_out_llsc_probe(TCGContext *s, TCGReg addr)
+{
+    int trexw = TARGET_LONG_BITS == 64 ? P_REXW : 0;
+
+    tcg_out_ld(s, TCG_TYPE_PTR, TCG_REG_L0, TCG_AREG0, LLSC_ADDR_OFS);
+    tcg_out_modrm_offset(s, OPC_CMP_GvEv + trexw, addr, TCG_REG_L0, 0);
+}
+
+/*
+ * A reservation that is still held implies the page is still protected,
+ * so a load-linked of the reserved address need not take it again.
+ */
+static void tcg_out_qemu_ll(TCGContext *s, const TCGArg *args)
+{
+    TCGReg addr = args[0];
+    TCGLabel *label_done = gen_new_label();
+
+    tcg_out_llsc_probe(s, addr);
+    tcg_out_jxx(s, JCC_JE, label_done, 1);
+
+    tcg_out_mov(s, TCG_TYPE_PTR, tcg_target_call_iarg_regs[0], TCG_AREG0);
+    tcg_out_mov(s, TCG_TYPE_TL, tcg_target_call_iarg_regs[1], addr);
+    tcg_out_call(s, (tcg_insn_unit *)helper_llsc_reserve);
+
+    tcg_out_label(s, label_done, s->code_ptr);
+}
+
+/*
+ * A store-conditional without a reservation on its address fails without
+ * leaving the TB.  Otherwise the check and the store must be atomic with
+ * respect to the fault handler, which only the helper can provide.
+ */
+static void tcg_out_qemu_sc(TCGContext *s, const TCGArg *args)
+{
+    TCGReg ret = args[0];
+    TCGReg addr = args[1];
+    TCGReg cmpv = args[2];
+    TCGReg newv = args[3];
+    TCGArg memop = args[4];
+    TCGLabel *label_slow = gen_new_label();
+    TCGLabel *label_done = gen_new_label();
+
+    tcg_out_llsc_probe(s, addr);
+    tcg_out_jxx(s, JCC_JE, label_slow, 1);
+    tcg_out_movi(s, TCG_TYPE_I32, ret, 1);
+    tcg_out_jxx(s, JCC_JMP, label_done, 1);
+
+    tcg_out_label(s, label_slow, s->code_ptr);
+    tcg_out_mov(s, TCG_TYPE_PTR, tcg_target_call_iarg_regs[0], TCG_AREG0);
+    tcg_out_mov(s, TCG_TYPE_TL, tcg_target_call_iarg_regs[1], addr);
+    tcg_out_mov(s, TCG_TYPE_I64, tcg_target_call_iarg_regs[2], cmpv);
+    tcg_out_mov(s, TCG_TYPE_I64, tcg_target_call_iarg_regs[3], newv);
+    tcg_out_movi(s, TCG_TYPE_I32, tcg_target_call_iarg_regs[4], memop);
+    tcg_out_call(s, (tcg_insn_unit *)helper_llsc_sc);
+
+    tcg_out_label(s, label_done, s->code_ptr);
+}
+#endif
+
 static inline void tcg_out_op(TCGContext *s, TCGOpcode opc,
                               const TCGArg *args, const int *const_args)
 {
@@ -2536,6 +2613,14 @@ static inline void tcg_out_op(TCGContext *s, TCGOpcode opc,
     case INDEX_op_qemu_st_i64:
         tcg_out_qemu_st(s, args, 1);
         break;
+#if TCG_TARGET_HAS_qemu_llsc
+    case INDEX_op_qemu_ll:
+        tcg_out_qemu_ll(s, args);
+        break;
+    case INDEX_op_qemu_sc:
+        tcg_out_qemu_sc(s, args);
+        break;
+#endif
 
     OP_32_64(mulu2):
         tcg_out_modrm(s, OPC_GRP3_Ev + rexw, EXT3_MUL, args[3]);
@@ -3190,6 +3275,20 @@ static const TCGTargetOpDef *tcg_target_op_def(TCGOpcode op)
                 : TARGET_LONG_BITS <= TCG_TARGET_REG_BITS ? &L_L_L
                 : &L_L_L_L);
 
+#if TCG_TARGET_HAS_qemu_llsc
+    case INDEX_op_qemu_ll:
+        {
+            static const TCGTargetOpDef ll = { .args_ct_str = { "C" } };
+            return &ll;
+        }
+    case INDEX_op_qemu_sc:
+        {
+            static const TCGTargetOpDef sc
+                = { .args_ct_str = { "a", "C", "C", "C" } };
+            return &sc;
+        }
+#endif
+
     case INDEX_op_brcond2_i32:
         {
             static const TCGTargetOpDef b2
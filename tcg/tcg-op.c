@@ -3023,27 +3023,6 @@ typedef void (*gen_atomic_op_i64)(TCGv_i64, TCGv_env, TCGv, TCGv_i64);
 # define WITH_ATOMIC64(X)
 #endif
 
-// void tcg_gen_pf_llsc_add(TCGv addr, TCGv_i64 node_addr)
-// {
-    // gen_helper_pf_llsc_add(addr, node_addr);
-// }
-
-void tcg_gen_ldex_count(TCGv addr)
-{
-    gen_helper_offload_load_exclusive_count(addr);
-}
-
-void tcg_gen_stex_count(TCGv addr)
-{
-    gen_helper_offload_store_exclusive_count(addr);
-}
-
-void tcg_gen_print_aa32_addr(TCGv_i32 addr)
-{
-    gen_helper_print_aa32_addr(addr);
-}
-
-
 static void * const table_cmpxchg[16] = {
     [MO_8] = gen_helper_atomic_cmpxchgb,
     [MO_16 | MO_LE] = gen_helper_atomic_cmpxchgw_le,
@@ -3054,54 +3033,6 @@ static void * const table_cmpxchg[16] = {
     WITH_ATOMIC64([MO_64 | MO_BE] = gen_helper_atomic_cmpxchgq_be)
 };
 
-// Handler sc succeed condition through exclusive monitor.
-void tcg_gen_x_monitor_cmpxchg_i32(TCGv_i32 retv, TCGv addr, TCGv_i32 cmpv,
-                                TCGv_i32 newv, TCGArg idx, TCGMemOp memop)
-{
-    memop = tcg_canonicalize_memop(memop, 0, 0);
-
-	// we suppose this is a multi-threaded guest program. 
-	// TODO: can be optimized?
-    if (0 && !(tcg_ctx->tb_cflags & CF_PARALLEL)) {
-        TCGv_i32 t1 = tcg_temp_new_i32();
-        TCGv_i32 t2 = tcg_temp_new_i32();
-
-        tcg_gen_ext_i32(t2, cmpv, memop & MO_SIZE);
-
-        tcg_gen_qemu_ld_i32(t1, addr, idx, memop & ~MO_SIGN);
-        tcg_gen_movcond_i32(TCG_COND_EQ, t2, t1, t2, newv, t1);
-        tcg_gen_qemu_st_i32(t2, addr, idx, memop);
-        tcg_temp_free_i32(t2);
-
-        if (memop & MO_SIGN) {
-            tcg_gen_ext_i32(retv, t1, memop);
-        } else {
-            tcg_gen_mov_i32(retv, t1);
-        }
-        tcg_temp_free_i32(t1);
-    } else {
-        gen_atomic_cx_i32 gen;
-
-        gen = table_cmpxchg[memop & (MO_SIZE | MO_BSWAP)];
-        tcg_debug_assert(gen != NULL);
-
-#ifdef CONFIG_SOFTMMU
-        {
-            TCGv_i32 oi = tcg_const_i32(make_memop_idx(memop & ~MO_SIGN, idx));
-            gen(retv, cpu_env, addr, cmpv, newv, oi);
-            tcg_temp_free_i32(oi);
-        }
-#else
-        //gen(retv, cpu_env, addr, cmpv, newv);
-		gen_helper_x_monitor_sc(retv, cpu_env, addr, cmpv, newv);
-#endif
-
-        if (memop & MO_SIGN) {
-            tcg_gen_ext_i32(retv, retv, memop);
-        }
-    }
-}
-
 void tcg_gen_atomic_cmpxchg_i32(TCGv_i32 retv, TCGv addr, TCGv_i32 cmpv,
                                 TCGv_i32 newv, TCGArg idx, TCGMemOp memop)
 {
@@ -3210,6 +3141,168 @@ void tcg_gen_atomic_cmpxchg_i64(TCGv_i64 retv, TCGv addr, TCGv_i64 cmpv,
     }
 }
 
+#ifdef CONFIG_LINUX_USER
+#if TARGET_LONG_BITS == 32
+# define tcgv_tl_arg  tcgv_i32_arg
+#else
+# define tcgv_tl_arg  tcgv_i64_arg
+#endif
+
+/*
+ * Backends with TCG_TARGET_HAS_qemu_llsc probe the reservation inline and
+ * only call the helpers below when it does not settle the outcome.  The
+ * helpers do the counting for -llsc-stats, so the probe is skipped then.
+ */
+static bool tcg_llsc_inline(void)
+{
+    return TCG_TARGET_HAS_qemu_llsc && !tcg_llsc_stats_enabled();
+}
+
+void tcg_gen_llsc_reserve(TCGv addr)
+{
+    if (tcg_llsc_inline()) {
+        tcg_gen_op1(INDEX_op_qemu_ll, tcgv_tl_arg(addr));
+    } else {
+        gen_helper_llsc_reserve(cpu_env, addr);
+    }
+}
+
+void tcg_gen_llsc_clrex(void)
+{
+    gen_helper_llsc_clrex(cpu_env);
+}
+
+void tcg_gen_llsc_store_cond_i64(TCGv_i64 ret, TCGv addr, TCGv_i64 cmpv,
+                                 TCGv_i64 newv, TCGMemOp memop)
+{
+    TCGv_i32 mop;
+
+    memop = tcg_canonicalize_memop(memop, 1, 1);
+    memop &= MO_SIZE | MO_BSWAP;
+    if (tcg_llsc_inline()) {
+        tcg_gen_op5(INDEX_op_qemu_sc, tcgv_i64_arg(ret), tcgv_tl_arg(addr),
+                    tcgv_i64_arg(cmpv), tcgv_i64_arg(newv), memop);
+        return;
+    }
+    mop = tcg_const_i32(memop);
+    gen_helper_llsc_sc(ret, cpu_env, addr, cmpv, newv, mop);
+    tcg_temp_free_i32(mop);
+}
+
+void tcg_gen_llsc_store_cond_i32(TCGv_i32 ret, TCGv addr, TCGv_i32 cmpv,
+                                 TCGv_i32 newv, TCGMemOp memop)
+{
+    TCGv_i64 c64 = tcg_temp_new_i64();
+    TCGv_i64 n64 = tcg_temp_new_i64();
+
+    tcg_gen_extu_i32_i64(c64, cmpv);
+    tcg_gen_extu_i32_i64(n64, newv);
+    tcg_gen_llsc_store_cond_i64(n64, addr, c64, n64, memop);
+    tcg_gen_extrl_i64_i32(ret, n64);
+    tcg_temp_free_i64(n64);
+    tcg_temp_free_i64(c64);
+}
+
+void tcg_gen_llsc_store_cond_pair_i64(TCGv_i64 ret, TCGv addr,
+                                      TCGv_i64 cmplo, TCGv_i64 cmphi,
+                                      TCGv_i64 newlo, TCGv_i64 newhi,
+                                      TCGMemOp memop)
+{
+    tcg_debug_assert((memop & MO_SIZE) == MO_64);
+    if ((memop & MO_BSWAP) == MO_LE) {
+        gen_helper_llsc_sc_pair_le(ret, cpu_env, addr, cmplo, cmphi,
+                                   newlo, newhi);
+    } else {
+        gen_helper_llsc_sc_pair_be(ret, cpu_env, addr, cmplo, cmphi,
+                                   newlo, newhi);
+    }
+}
+
+void tcg_gen_llsc_stat(int stat)
+{
+    if (tcg_llsc_stats_enabled()) {
+        TCGv_i32 t = tcg_const_i32(stat);
+
+        gen_helper_llsc_stat(t);
+        tcg_temp_free_i32(t);
+    }
+}
+
+void tcg_gen_llsc_stat_sc(TCGv_i64 status)
+{
+    if (tcg_llsc_stats_enabled()) {
+        gen_helper_llsc_stat_sc(status);
+    }
+}
+
+void tcg_gen_llsc_profile_ll(target_ulong pc)
+{
+    if (tcg_llsc_profile_enabled()) {
+        TCGv t = tcg_const_tl(pc);
+
+        gen_helper_llsc_profile_ll(t);
+        tcg_temp_free(t);
+    }
+}
+
+void tcg_gen_llsc_profile_sc(target_ulong pc, TCGv_i64 status)
+{
+    if (tcg_llsc_profile_enabled()) {
+        TCGv t = tcg_const_tl(pc);
+
+        gen_helper_llsc_profile_sc(t, status);
+        tcg_temp_free(t);
+    }
+}
+#else
+/* Only reachable when tcg_llsc_enabled(), which it never is here.  */
+void tcg_gen_llsc_reserve(TCGv addr)
+{
+    g_assert_not_reached();
+}
+
+void tcg_gen_llsc_clrex(void)
+{
+    g_assert_not_reached();
+}
+
+void tcg_gen_llsc_store_cond_i64(TCGv_i64 ret, TCGv addr, TCGv_i64 cmpv,
+                                 TCGv_i64 newv, TCGMemOp memop)
+{
+    g_assert_not_reached();
+}
+
+void tcg_gen_llsc_store_cond_i32(TCGv_i32 ret, TCGv addr, TCGv_i32 cmpv,
+                                 TCGv_i32 newv, TCGMemOp memop)
+{
+    g_assert_not_reached();
+}
+
+void tcg_gen_llsc_store_cond_pair_i64(TCGv_i64 ret, TCGv addr,
+                                      TCGv_i64 cmplo, TCGv_i64 cmphi,
+                                      TCGv_i64 newlo, TCGv_i64 newhi,
+                                      TCGMemOp memop)
+{
+    g_assert_not_reached();
+}
+
+void tcg_gen_llsc_stat(int stat)
+{
+}
+
+void tcg_gen_llsc_stat_sc(TCGv_i64 status)
+{
+}
+
+void tcg_gen_llsc_profile_ll(target_ulong pc)
+{
+}
+
+void tcg_gen_llsc_profile_sc(target_ulong pc, TCGv_i64 status)
+{
+}
+#endif /* CONFIG_LINUX_USER */
+
 static void do_nonatomic_op_i32(TCGv_i32 ret, TCGv addr, TCGv_i32 val,
                                 TCGArg idx, TCGMemOp memop, bool new_val,
                                 void (*gen)(TCGv_i32, TCGv_i32, TCGv_i32))
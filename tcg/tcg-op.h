@@ -855,12 +855,6 @@ void tcg_gen_qemu_ld_i32(TCGv_i32, TCGv, TCGArg, TCGMemOp);
 void tcg_gen_qemu_st_i32(TCGv_i32, TCGv, TCGArg, TCGMemOp);
 void tcg_gen_qemu_ld_i64(TCGv_i64, TCGv, TCGArg, TCGMemOp);
 void tcg_gen_qemu_st_i64(TCGv_i64, TCGv, TCGArg, TCGMemOp);
-void tcg_gen_ldex_count(TCGv);
-void tcg_gen_stex_count(TCGv);
-void tcg_gen_print_aa32_addr(TCGv_i32);
-void tcg_gen_pf_llsc_add(TCGv, TCGv_i64);
-void tcg_gen_x_monitor_cmpxchg_i32(TCGv_i32, TCGv, TCGv_i32,
-                                TCGv_i32, TCGArg, TCGMemOp);
 
 static inline void tcg_gen_qemu_ld8u(TCGv ret, TCGv addr, int mem_index)
 {
@@ -922,6 +916,60 @@ void tcg_gen_atomic_cmpxchg_i32(TCGv_i32, TCGv, TCGv_i32, TCGv_i32,
 void tcg_gen_atomic_cmpxchg_i64(TCGv_i64, TCGv, TCGv_i64, TCGv_i64,
                                 TCGArg, TCGMemOp);
 
+/*
+ * ABA-safe LL/SC for linux-user guests, see accel/tcg/llsc.c.  While
+ * tcg_llsc_enabled(), a target takes the reservation of its load-linked
+ * with tcg_gen_llsc_reserve() before loading, and completes its
+ * store-conditional with tcg_gen_llsc_store_cond_*().  These set RET to 0
+ * if the value was stored, and to 1 if the reservation was lost or memory
+ * no longer holds CMPV.
+ */
+#ifdef CONFIG_LINUX_USER
+bool tcg_llsc_enabled(void);
+bool tcg_llsc_stats_enabled(void);
+bool tcg_llsc_profile_enabled(void);
+#else
+static inline bool tcg_llsc_enabled(void)
+{
+    return false;
+}
+
+static inline bool tcg_llsc_stats_enabled(void)
+{
+    return false;
+}
+
+static inline bool tcg_llsc_profile_enabled(void)
+{
+    return false;
+}
+#endif
+void tcg_gen_llsc_reserve(TCGv);
+/* Drop the reservation, for instructions that clear the exclusive monitor.  */
+void tcg_gen_llsc_clrex(void);
+void tcg_gen_llsc_store_cond_i32(TCGv_i32, TCGv, TCGv_i32, TCGv_i32,
+                                 TCGMemOp);
+void tcg_gen_llsc_store_cond_i64(TCGv_i64, TCGv, TCGv_i64, TCGv_i64,
+                                 TCGMemOp);
+/* Doubleword pair at ADDR and ADDR + 8, the first one in CMPLO/NEWLO.  */
+void tcg_gen_llsc_store_cond_pair_i64(TCGv_i64, TCGv, TCGv_i64, TCGv_i64,
+                                      TCGv_i64, TCGv_i64, TCGMemOp);
+/*
+ * Count an LLSCStat event for -llsc-stats, a store-conditional outcome
+ * also counting as a store-conditional; no code is emitted while the
+ * statistics are off.  The PST helpers count for themselves, these are
+ * for the paths that do not reach them.  tcg_gen_llsc_stat_sc() counts
+ * a store-conditional done as a cmpxchg, from its guest status.
+ */
+void tcg_gen_llsc_stat(int);
+void tcg_gen_llsc_stat_sc(TCGv_i64);
+/*
+ * Per-PC profile for -llsc-profile, likewise free while it is off: a
+ * load-linked at PC, and a store-conditional at PC with guest STATUS.
+ */
+void tcg_gen_llsc_profile_ll(target_ulong);
+void tcg_gen_llsc_profile_sc(target_ulong, TCGv_i64);
+
 void tcg_gen_atomic_xchg_i32(TCGv_i32, TCGv, TCGv_i32, TCGArg, TCGMemOp);
 void tcg_gen_atomic_xchg_i64(TCGv_i64, TCGv, TCGv_i64, TCGArg, TCGMemOp);
 
@@ -1110,6 +1158,7 @@ void tcg_gen_stl_vec(TCGv_vec r, TCGv_ptr base, TCGArg offset, TCGType t);
 #define tcg_gen_smax_tl tcg_gen_smax_i64
 #define tcg_gen_umax_tl tcg_gen_umax_i64
 #define tcg_gen_atomic_cmpxchg_tl tcg_gen_atomic_cmpxchg_i64
+#define tcg_gen_llsc_store_cond_tl tcg_gen_llsc_store_cond_i64
 #define tcg_gen_atomic_xchg_tl tcg_gen_atomic_xchg_i64
 #define tcg_gen_atomic_fetch_add_tl tcg_gen_atomic_fetch_add_i64
 #define tcg_gen_atomic_fetch_and_tl tcg_gen_atomic_fetch_and_i64
@@ -1222,6 +1271,7 @@ void tcg_gen_stl_vec(TCGv_vec r, TCGv_ptr base, TCGArg offset, TCGType t);
 #define tcg_gen_smax_tl tcg_gen_smax_i32
 #define tcg_gen_umax_tl tcg_gen_umax_i32
 #define tcg_gen_atomic_cmpxchg_tl tcg_gen_atomic_cmpxchg_i32
+#define tcg_gen_llsc_store_cond_tl tcg_gen_llsc_store_cond_i32
 #define tcg_gen_atomic_xchg_tl tcg_gen_atomic_xchg_i32
 #define tcg_gen_atomic_fetch_add_tl tcg_gen_atomic_fetch_add_i32
 #define tcg_gen_atomic_fetch_and_tl tcg_gen_atomic_fetch_and_i32
@@ -1276,6 +1326,14 @@ static inline void tcg_gen_brcondi_ptr(TCGCond cond, TCGv_ptr a,
     glue(tcg_gen_brcondi_,PTR)(cond, (NAT)a, b, label);
 }
 
+static inline void tcg_gen_movcond_ptr(TCGCond cond, TCGv_ptr r,
+                                       TCGv_ptr c1, TCGv_ptr c2,
+                                       TCGv_ptr v1, TCGv_ptr v2)
+{
+    glue(tcg_gen_movcond_,PTR)(cond, (NAT)r, (NAT)c1, (NAT)c2,
+                               (NAT)v1, (NAT)v2);
+}
+
 static inline void tcg_gen_ext_i32_ptr(TCGv_ptr r, TCGv_i32 a)
 {
 #if UINTPTR_MAX == UINT32_MAX
@@ -206,6 +206,12 @@ DEF(qemu_ld_i64, DATA64_ARGS, TLADDR_ARGS, 1,
     TCG_OPF_CALL_CLOBBER | TCG_OPF_SIDE_EFFECTS | TCG_OPF_64BIT)
 DEF(qemu_st_i64, 0, TLADDR_ARGS + DATA64_ARGS, 1,
     TCG_OPF_CALL_CLOBBER | TCG_OPF_SIDE_EFFECTS | TCG_OPF_64BIT)
+DEF(qemu_ll, 0, TLADDR_ARGS, 0,
+    TCG_OPF_CALL_CLOBBER | TCG_OPF_SIDE_EFFECTS
+    | IMPL(TCG_TARGET_HAS_qemu_llsc))
+DEF(qemu_sc, DATA64_ARGS, TLADDR_ARGS + 2 * DATA64_ARGS, 1,
+    TCG_OPF_CALL_CLOBBER | TCG_OPF_SIDE_EFFECTS | TCG_OPF_64BIT
+    | IMPL(TCG_TARGET_HAS_qemu_llsc))
 
 /* Host vector support.  */
 
@@ -1409,6 +1409,10 @@ bool tcg_op_supported(TCGOpcode op)
     case INDEX_op_goto_ptr:
         return TCG_TARGET_HAS_goto_ptr;
 
+    case INDEX_op_qemu_ll:
+    case INDEX_op_qemu_sc:
+        return TCG_TARGET_HAS_qemu_llsc;
+
     case INDEX_op_mov_i32:
     case INDEX_op_movi_i32:
     case INDEX_op_setcond_i32:
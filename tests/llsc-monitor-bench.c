@@ -0,0 +1,682 @@
+/*
+ * Exclusive monitor microbenchmark
+ *
+ * Drives the set_exclusive/check_exclusive/check_and_clean interface of
+ * the linux-user exclusive monitor from host threads, without a guest.
+ * The monitor proper is built per target, so the designs under test are
+ * modeled here on host addresses and must be kept in step with
+ * linux-user/x-monitor.c:
+ *
+ *  list:  the original monitor, one list of all threads under one mutex
+ *  table: the page-indexed radix table, one spinlocked entry per page
+ *
+ * License: GNU GPL, version 2 or later.
+ *   See the COPYING file in the top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "qemu/thread.h"
+#include "qemu/host-utils.h"
+#include "qemu/processor.h"
+#include "qemu/queue.h"
+#include "qemu/timer.h"
+
+#define BENCH_PAGE_BITS 12
+#define BENCH_PAGE_SIZE (1 << BENCH_PAGE_BITS)
+/* keep address 0, which means "no reservation", out of the range */
+#define BENCH_BASE (16 * BENCH_PAGE_SIZE)
+#define BENCH_ADDR_BITS 32
+
+enum bench_op {
+    OP_LL,
+    OP_SC,
+    OP_ST,
+    OP_NR,
+};
+
+static const char * const op_names[OP_NR] = {
+    [OP_LL] = "ll",
+    [OP_SC] = "sc",
+    [OP_ST] = "store",
+};
+
+/*
+ * Latency histogram: exact below 8ns, then 8 linear buckets per power of
+ * two, which keeps percentiles within 12.5%.
+ */
+#define HIST_SUB_BITS 3
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) * HIST_SUB)
+
+static unsigned int hist_index(uint64_t ns)
+{
+    int msb;
+
+    if (ns < HIST_SUB) {
+        return ns;
+    }
+    msb = 63 - clz64(ns);
+    return (msb - HIST_SUB_BITS + 1) * HIST_SUB +
+           ((ns >> (msb - HIST_SUB_BITS)) & (HIST_SUB - 1));
+}
+
+/* The smallest latency that falls into bucket IDX.  */
+static uint64_t hist_value(unsigned int idx)
+{
+    int msb;
+
+    if (idx < HIST_SUB) {
+        return idx;
+    }
+    msb = idx / HIST_SUB + HIST_SUB_BITS - 1;
+    return (uint64_t)(HIST_SUB + idx % HIST_SUB) << (msb - HIST_SUB_BITS);
+}
+
+struct thread_stats {
+    size_t ops[OP_NR];
+    size_t sc_ok;
+    uint64_t max_ns[OP_NR];
+    uint64_t hist[OP_NR][HIST_BUCKETS];
+};
+
+struct thread_info {
+    struct thread_stats stats;
+    uint64_t r;
+    void *node;
+    /* address of the last load-exclusive, for the next store-conditional */
+    uint64_t ll_addr;
+} QEMU_ALIGNED(64); /* avoid false sharing among threads */
+
+struct monitor_ops {
+    const char *name;
+    void (*init)(void);
+    void *(*register_thread)(int tid);
+    void (*set_exclusive)(void *node, uint64_t addr);
+    bool (*check_exclusive)(void *node, uint64_t addr);
+    void (*check_and_clean)(uint64_t addr);
+};
+
+/*
+ * list: every reservation on one list under one mutex, and a store scans
+ * all of them for its page.
+ */
+struct list_node {
+    uint64_t exclusive_addr;
+    uint64_t page_addr;
+    QLIST_ENTRY(list_node) next;
+} QEMU_ALIGNED(64);
+
+static QemuMutex list_lock;
+static QLIST_HEAD(, list_node) list_nodes;
+
+static void list_init(void)
+{
+    qemu_mutex_init(&list_lock);
+    QLIST_INIT(&list_nodes);
+}
+
+static void *list_register_thread(int tid)
+{
+    struct list_node *p = qemu_memalign(64, sizeof(*p));
+
+    memset(p, 0, sizeof(*p));
+    qemu_mutex_lock(&list_lock);
+    QLIST_INSERT_HEAD(&list_nodes, p, next);
+    qemu_mutex_unlock(&list_lock);
+    return p;
+}
+
+static void list_set_exclusive(void *node, uint64_t addr)
+{
+    struct list_node *p = node;
+
+    qemu_mutex_lock(&list_lock);
+    atomic_set(&p->exclusive_addr, addr);
+    p->page_addr = addr >> BENCH_PAGE_BITS;
+    qemu_mutex_unlock(&list_lock);
+}
+
+static bool list_check_exclusive(void *node, uint64_t addr)
+{
+    struct list_node *p = node;
+
+    return atomic_xchg(&p->exclusive_addr, 0) == addr;
+}
+
+static void list_check_and_clean(uint64_t addr)
+{
+    struct list_node *p;
+
+    qemu_mutex_lock(&list_lock);
+    QLIST_FOREACH(p, &list_nodes, next) {
+        if (p->page_addr == addr >> BENCH_PAGE_BITS) {
+            atomic_set(&p->exclusive_addr, 0);
+        }
+    }
+    qemu_mutex_unlock(&list_lock);
+}
+
+/*
+ * table: two-level radix table of page entries, allocated on first use.
+ * A node is linked on the entry of the page it last reserved, and
+ * nr_reserved lets a store skip an entry nobody holds.
+ */
+#define TABLE_L2_BITS 10
+#define TABLE_L2_SIZE (1 << TABLE_L2_BITS)
+#define TABLE_L1_SIZE (1 << (BENCH_ADDR_BITS - BENCH_PAGE_BITS - TABLE_L2_BITS))
+
+struct table_node;
+
+struct table_page {
+    QemuSpin lock;
+    QLIST_HEAD(, table_node) nodes;
+    int nr_reserved;
+} QEMU_ALIGNED(64);
+
+struct table_node {
+    uint64_t exclusive_addr;
+    struct table_page *page;
+    QLIST_ENTRY(table_node) page_next;
+} QEMU_ALIGNED(64);
+
+static struct table_page *table_l1_map[TABLE_L1_SIZE];
+
+static void table_init(void)
+{
+}
+
+static struct table_page *table_find_alloc(uint64_t addr, bool alloc)
+{
+    uint64_t index = addr >> BENCH_PAGE_BITS;
+    struct table_page **lp = &table_l1_map[index >> TABLE_L2_BITS];
+    struct table_page *pd = atomic_rcu_read(lp);
+    int i;
+
+    if (pd == NULL) {
+        struct table_page *existing;
+
+        if (!alloc) {
+            return NULL;
+        }
+        pd = qemu_memalign(64, sizeof(*pd) * TABLE_L2_SIZE);
+        memset(pd, 0, sizeof(*pd) * TABLE_L2_SIZE);
+        for (i = 0; i < TABLE_L2_SIZE; i++) {
+            qemu_spin_init(&pd[i].lock);
+            QLIST_INIT(&pd[i].nodes);
+        }
+        existing = atomic_cmpxchg(lp, NULL, pd);
+        if (unlikely(existing)) {
+            qemu_vfree(pd);
+            pd = existing;
+        }
+    }
+    return pd + (index & (TABLE_L2_SIZE - 1));
+}
+
+static uint64_t table_drop(struct table_node *p)
+{
+    uint64_t old = atomic_xchg(&p->exclusive_addr, 0);
+
+    if (old && p->page) {
+        atomic_dec(&p->page->nr_reserved);
+    }
+    return old;
+}
+
+static void *table_register_thread(int tid)
+{
+    struct table_node *p = qemu_memalign(64, sizeof(*p));
+
+    memset(p, 0, sizeof(*p));
+    return p;
+}
+
+static void table_set_exclusive(void *node, uint64_t addr)
+{
+    struct table_node *p = node;
+    struct table_page *pd = table_find_alloc(addr, true);
+
+    if (p->page && p->page != pd) {
+        struct table_page *old = p->page;
+
+        qemu_spin_lock(&old->lock);
+        table_drop(p);
+        QLIST_REMOVE(p, page_next);
+        qemu_spin_unlock(&old->lock);
+        p->page = NULL;
+    }
+
+    qemu_spin_lock(&pd->lock);
+    if (p->page != pd) {
+        QLIST_INSERT_HEAD(&pd->nodes, p, page_next);
+        p->page = pd;
+    }
+    if (atomic_xchg(&p->exclusive_addr, addr) == 0) {
+        atomic_inc(&pd->nr_reserved);
+    }
+    qemu_spin_unlock(&pd->lock);
+}
+
+static bool table_check_exclusive(void *node, uint64_t addr)
+{
+    return table_drop(node) == addr;
+}
+
+static void table_check_and_clean(uint64_t addr)
+{
+    struct table_page *pd = table_find_alloc(addr, false);
+    struct table_node *p;
+
+    if (pd == NULL) {
+        return;
+    }
+    qemu_spin_lock(&pd->lock);
+    if (atomic_read(&pd->nr_reserved)) {
+        QLIST_FOREACH(p, &pd->nodes, page_next) {
+            table_drop(p);
+        }
+    }
+    qemu_spin_unlock(&pd->lock);
+}
+
+static const struct monitor_ops monitors[] = {
+    {
+        .name = "list",
+        .init = list_init,
+        .register_thread = list_register_thread,
+        .set_exclusive = list_set_exclusive,
+        .check_exclusive = list_check_exclusive,
+        .check_and_clean = list_check_and_clean,
+    },
+    {
+        .name = "table",
+        .init = table_init,
+        .register_thread = table_register_thread,
+        .set_exclusive = table_set_exclusive,
+        .check_exclusive = table_check_exclusive,
+        .check_and_clean = table_check_and_clean,
+    },
+};
+
+enum dist {
+    DIST_UNIFORM,
+    DIST_ZIPF,
+    DIST_PAGE,
+};
+
+static const char * const dist_names[] = {
+    [DIST_UNIFORM] = "uniform",
+    [DIST_ZIPF] = "zipf",
+    [DIST_PAGE] = "page",
+};
+
+static QemuThread *threads;
+static struct thread_info *th_info;
+static const struct monitor_ops *monitor = &monitors[1];
+static unsigned int n_threads = 1;
+static unsigned int n_ready_threads;
+static unsigned int duration = 1;
+static unsigned long range = 1024;
+static enum dist dist = DIST_UNIFORM;
+static double zipf_skew = 0.99;
+static double *zipf_cdf;
+static unsigned int ratio[OP_NR] = { 1, 1, 2 };
+static unsigned int ratio_sum;
+static bool test_start;
+static bool test_stop;
+
+static const char commands_string[] =
+    " -n = number of threads\n"
+    " -d = duration in seconds\n"
+    " -m = monitor: list, table (default)\n"
+    " -a = address distribution over pages: uniform (default), zipf, page\n"
+    "      (every access to one page)\n"
+    " -r = range of pages (will be rounded up to pow2)\n"
+    " -s = zipf skew, default 0.99\n"
+    " -o = LL:SC:store ratio, default 1:1:2";
+
+static void usage_complete(char *argv[])
+{
+    fprintf(stderr, "Usage: %s [options]\n", argv[0]);
+    fprintf(stderr, "options:\n%s\n", commands_string);
+}
+
+/*
+ * From: https://en.wikipedia.org/wiki/Xorshift
+ * This is faster than rand_r(), and gives us a wider range (RAND_MAX is only
+ * guaranteed to be >= INT_MAX).
+ */
+static uint64_t xorshift64star(uint64_t x)
+{
+    x ^= x >> 12; /* a */
+    x ^= x << 25; /* b */
+    x ^= x >> 27; /* c */
+    return x * UINT64_C(2685821657736338717);
+}
+
+static void zipf_init(void)
+{
+    double sum = 0;
+    unsigned long i;
+
+    zipf_cdf = g_new(double, range);
+    for (i = 0; i < range; i++) {
+        sum += 1.0 / pow(i + 1, zipf_skew);
+        zipf_cdf[i] = sum;
+    }
+    for (i = 0; i < range; i++) {
+        zipf_cdf[i] /= sum;
+    }
+}
+
+static unsigned long zipf_page(uint64_t r)
+{
+    double u = (r >> 11) * 0x1.0p-53;
+    unsigned long lo = 0, hi = range - 1;
+
+    while (lo < hi) {
+        unsigned long mid = (lo + hi) / 2;
+
+        if (zipf_cdf[mid] < u) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+/* A word-aligned address in the page picked by the distribution.  */
+static uint64_t pick_addr(uint64_t r)
+{
+    unsigned long page;
+
+    switch (dist) {
+    case DIST_ZIPF:
+        page = zipf_page(r);
+        break;
+    case DIST_PAGE:
+        page = 0;
+        break;
+    default:
+        page = r & (range - 1);
+        break;
+    }
+    return BENCH_BASE + ((uint64_t)page << BENCH_PAGE_BITS) +
+           ((r >> 40) & (BENCH_PAGE_SIZE - 4));
+}
+
+static enum bench_op pick_op(uint64_t r)
+{
+    unsigned int x = (r >> 32) % ratio_sum;
+    enum bench_op op;
+
+    for (op = 0; op < OP_NR - 1; op++) {
+        if (x < ratio[op]) {
+            break;
+        }
+        x -= ratio[op];
+    }
+    return op;
+}
+
+/*
+ * A store-conditional checks the reservation of the thread's last
+ * load-exclusive and, on success, its store breaks every reservation on
+ * the page, as a plain store does.
+ */
+static void do_op(struct thread_info *info, enum bench_op op, uint64_t addr)
+{
+    switch (op) {
+    case OP_LL:
+        monitor->set_exclusive(info->node, addr);
+        info->ll_addr = addr;
+        break;
+    case OP_SC:
+        if (monitor->check_exclusive(info->node, info->ll_addr)) {
+            monitor->check_and_clean(info->ll_addr);
+            info->stats.sc_ok++;
+        }
+        break;
+    default:
+        monitor->check_and_clean(addr);
+        break;
+    }
+}
+
+static void *thread_func(void *arg)
+{
+    struct thread_info *info = arg;
+    struct thread_stats *stats = &info->stats;
+
+    info->node = monitor->register_thread(info - th_info + 1);
+
+    atomic_inc(&n_ready_threads);
+    while (!atomic_read(&test_start)) {
+        cpu_relax();
+    }
+
+    while (!atomic_read(&test_stop)) {
+        enum bench_op op;
+        uint64_t addr, ns;
+        int64_t t0;
+
+        info->r = xorshift64star(info->r);
+        op = pick_op(info->r);
+        addr = pick_addr(info->r);
+
+        t0 = get_clock();
+        do_op(info, op, addr);
+        ns = get_clock() - t0;
+
+        stats->ops[op]++;
+        stats->hist[op][hist_index(ns)]++;
+        if (ns > stats->max_ns[op]) {
+            stats->max_ns[op] = ns;
+        }
+    }
+    return NULL;
+}
+
+static void run_test(void)
+{
+    unsigned int i;
+
+    while (atomic_read(&n_ready_threads) != n_threads) {
+        cpu_relax();
+    }
+
+    atomic_set(&test_start, true);
+    g_usleep(duration * G_USEC_PER_SEC);
+    atomic_set(&test_stop, true);
+
+    for (i = 0; i < n_threads; i++) {
+        qemu_thread_join(&threads[i]);
+    }
+}
+
+static void create_threads(void)
+{
+    unsigned int i;
+
+    threads = g_new(QemuThread, n_threads);
+    th_info = qemu_memalign(64, sizeof(*th_info) * n_threads);
+    memset(th_info, 0, sizeof(*th_info) * n_threads);
+
+    for (i = 0; i < n_threads; i++) {
+        struct thread_info *info = &th_info[i];
+
+        info->r = (i + 1) ^ time(NULL);
+        qemu_thread_create(&threads[i], NULL, thread_func, info,
+                           QEMU_THREAD_JOINABLE);
+    }
+}
+
+static void pr_params(void)
+{
+    printf("Parameters:\n");
+    printf(" monitor:           %s\n", monitor->name);
+    printf(" # of threads:      %u\n", n_threads);
+    printf(" duration:          %u\n", duration);
+    printf(" distribution:      %s", dist_names[dist]);
+    if (dist == DIST_ZIPF) {
+        printf(" (skew %.2f)", zipf_skew);
+    }
+    printf("\n");
+    printf(" page range:        %lu\n", range);
+    printf(" LL:SC:store ratio: %u:%u:%u\n", ratio[OP_LL], ratio[OP_SC],
+           ratio[OP_ST]);
+}
+
+/* The latency below which a fraction P of the N samples in HIST fall.  */
+static uint64_t hist_percentile(const uint64_t *hist, size_t n, double p)
+{
+    uint64_t target = n * p;
+    uint64_t sum = 0;
+    unsigned int i;
+
+    for (i = 0; i < HIST_BUCKETS; i++) {
+        sum += hist[i];
+        if (sum > target) {
+            return hist_value(i);
+        }
+    }
+    return hist_value(HIST_BUCKETS - 1);
+}
+
+static void pr_stats(void)
+{
+    static uint64_t hist[OP_NR][HIST_BUCKETS];
+    size_t ops[OP_NR] = { 0 };
+    uint64_t max_ns[OP_NR] = { 0 };
+    size_t total = 0, sc_ok = 0;
+    unsigned int i, j;
+    enum bench_op op;
+    double tx;
+
+    for (i = 0; i < n_threads; i++) {
+        const struct thread_stats *s = &th_info[i].stats;
+
+        for (op = 0; op < OP_NR; op++) {
+            ops[op] += s->ops[op];
+            max_ns[op] = MAX(max_ns[op], s->max_ns[op]);
+            for (j = 0; j < HIST_BUCKETS; j++) {
+                hist[op][j] += s->hist[op][j];
+            }
+        }
+        sc_ok += s->sc_ok;
+    }
+    for (op = 0; op < OP_NR; op++) {
+        total += ops[op];
+    }
+    tx = (double)total / duration / 1e6;
+
+    printf("Results:\n");
+    printf("Duration:            %u s\n", duration);
+    printf(" Throughput:         %.2f Mops/s\n", tx);
+    printf(" Throughput/thread:  %.2f Mops/s/thread\n", tx / n_threads);
+    printf(" SC success:         %.2f %%\n",
+           ops[OP_SC] ? 100.0 * sc_ok / ops[OP_SC] : 0.0);
+    printf(" Latency (ns, including clock reads):\n");
+    printf("  %-6s %12s %8s %8s %8s %8s %8s\n", "op", "count", "p50", "p90",
+           "p99", "p99.9", "max");
+    for (op = 0; op < OP_NR; op++) {
+        if (!ops[op]) {
+            continue;
+        }
+        printf("  %-6s %12zu %8" PRIu64 " %8" PRIu64 " %8" PRIu64
+               " %8" PRIu64 " %8" PRIu64 "\n", op_names[op], ops[op],
+               hist_percentile(hist[op], ops[op], 0.5),
+               hist_percentile(hist[op], ops[op], 0.9),
+               hist_percentile(hist[op], ops[op], 0.99),
+               hist_percentile(hist[op], ops[op], 0.999),
+               max_ns[op]);
+    }
+}
+
+static void parse_ratio(const char *str)
+{
+    if (sscanf(str, "%u:%u:%u", &ratio[OP_LL], &ratio[OP_SC],
+               &ratio[OP_ST]) != 3) {
+        fprintf(stderr, "Invalid ratio '%s', expected LL:SC:store\n", str);
+        exit(1);
+    }
+}
+
+static void parse_args(int argc, char *argv[])
+{
+    int c;
+    unsigned int i;
+
+    for (;;) {
+        c = getopt(argc, argv, "a:d:hm:n:o:r:s:");
+        if (c < 0) {
+            break;
+        }
+        switch (c) {
+        case 'a':
+            for (i = 0; i < ARRAY_SIZE(dist_names); i++) {
+                if (!strcmp(optarg, dist_names[i])) {
+                    dist = i;
+                    break;
+                }
+            }
+            if (i == ARRAY_SIZE(dist_names)) {
+                fprintf(stderr, "Unknown distribution '%s'\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'd':
+            duration = atoi(optarg);
+            break;
+        case 'h':
+            usage_complete(argv);
+            exit(0);
+        case 'm':
+            for (i = 0; i < ARRAY_SIZE(monitors); i++) {
+                if (!strcmp(optarg, monitors[i].name)) {
+                    monitor = &monitors[i];
+                    break;
+                }
+            }
+            if (i == ARRAY_SIZE(monitors)) {
+                fprintf(stderr, "Unknown monitor '%s'\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'n':
+            n_threads = atoi(optarg);
+            break;
+        case 'o':
+            parse_ratio(optarg);
+            break;
+        case 'r':
+            range = pow2ceil(atol(optarg));
+            break;
+        case 's':
+            zipf_skew = atof(optarg);
+            break;
+        }
+    }
+
+    ratio_sum = ratio[OP_LL] + ratio[OP_SC] + ratio[OP_ST];
+    if (ratio_sum == 0) {
+        fprintf(stderr, "The LL:SC:store ratio must not be all zero\n");
+        exit(1);
+    }
+    /* the table model indexes a 32-bit address space */
+    range = MIN(range, 1ul << (BENCH_ADDR_BITS - BENCH_PAGE_BITS - 1));
+}
+
+int main(int argc, char *argv[])
+{
+    parse_args(argc, argv);
+    if (dist == DIST_ZIPF) {
+        zipf_init();
+    }
+    monitor->init();
+    pr_params();
+    create_threads();
+    run_test();
+    pr_stats();
+    return 0;
+}
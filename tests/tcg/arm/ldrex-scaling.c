@@ -0,0 +1,126 @@
+/*
+ * LDREX/STREX scaling benchmark
+ *
+ * Each thread increments a counter with a LDREX/STREX loop, either one
+ * counter shared by all threads or one private counter per thread (on
+ * its own cache line), and the aggregate throughput is reported.  The
+ * private mode measures the cost of an uncontended exclusive pair, which
+ * is what suffers when the emulation serialises every pair.
+ *
+ * Usage: ldrex-scaling [shared|private] [threads] [iterations]
+ *
+ * The final counts are checked, so this also runs as a test.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define MAX_THREADS 64
+
+typedef struct {
+    uint32_t count;
+} __attribute__((aligned(64))) Counter;
+
+static Counter counters[MAX_THREADS];
+static int nr_threads = 4;
+static uint32_t iterations = 100000;
+static int shared = 1;
+static pthread_barrier_t barrier;
+
+static inline void excl_inc(uint32_t *p)
+{
+    uint32_t tmp, fail;
+
+    asm volatile("1: ldrex   %0, [%2]\n"
+                 "   add     %0, %0, #1\n"
+                 "   strex   %1, %0, [%2]\n"
+                 "   teq     %1, #0\n"
+                 "   bne     1b\n"
+                 : "=&r"(tmp), "=&r"(fail)
+                 : "r"(p)
+                 : "cc", "memory");
+}
+
+static void *thread_func(void *arg)
+{
+    uint32_t *p = &counters[shared ? 0 : (uintptr_t)arg].count;
+    uint32_t i;
+
+    pthread_barrier_wait(&barrier);
+    for (i = 0; i < iterations; i++) {
+        excl_inc(p);
+    }
+    return NULL;
+}
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+int main(int argc, char **argv)
+{
+    pthread_t threads[MAX_THREADS];
+    uint64_t total = 0;
+    double start, secs;
+    int i;
+
+    if (argc > 1) {
+        if (!strcmp(argv[1], "shared")) {
+            shared = 1;
+        } else if (!strcmp(argv[1], "private")) {
+            shared = 0;
+        } else {
+            fprintf(stderr, "unknown mode '%s' (shared, private)\n", argv[1]);
+            return 2;
+        }
+    }
+    if (argc > 2) {
+        nr_threads = atoi(argv[2]);
+        if (nr_threads < 1 || nr_threads > MAX_THREADS) {
+            fprintf(stderr, "threads must be between 1 and %d\n",
+                    MAX_THREADS);
+            return 2;
+        }
+    }
+    if (argc > 3) {
+        iterations = strtoul(argv[3], NULL, 0);
+    }
+
+    pthread_barrier_init(&barrier, NULL, nr_threads + 1);
+    for (i = 0; i < nr_threads; i++) {
+        pthread_create(&threads[i], NULL, thread_func, (void *)(uintptr_t)i);
+    }
+    start = now();
+    pthread_barrier_wait(&barrier);
+    for (i = 0; i < nr_threads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    secs = now() - start;
+
+    for (i = 0; i < MAX_THREADS; i++) {
+        total += counters[i].count;
+    }
+    printf("%s threads %d: %" PRIu64 " ops in %.3fs, %.2f Mops/s\n",
+           shared ? "shared" : "private", nr_threads, total, secs,
+           total / secs / 1e6);
+
+    if (total != (uint64_t)nr_threads * iterations) {
+        fprintf(stderr, "FAIL: expected %" PRIu64 " increments\n",
+                (uint64_t)nr_threads * iterations);
+        return 1;
+    }
+    return 0;
+}
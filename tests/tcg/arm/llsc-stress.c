@@ -0,0 +1,713 @@
+/*
+ * LL/SC stress and throughput suite
+ *
+ * Concurrent algorithms built on LDREX/STREX, each run by several threads
+ * and checked for lost updates, broken mutual exclusion or corruption by
+ * the ABA problem, which an LL/SC emulation based on compare-and-swap of
+ * the loaded value lets through:
+ *
+ *   treiber    Treiber stack; pop leaves a window between its LDREX of the
+ *              head and its STREX in which others pop and push it back
+ *   mcs        MCS queue lock guarding a plain counter
+ *   ticket     ticket spinlock guarding a plain counter
+ *   seqlock    writers claim the sequence with STREX, readers check that
+ *              they never see a torn pair
+ *   spsc       single-producer single-consumer rings, one per thread pair
+ *   mpmc       bounded multi-producer multi-consumer queue
+ *   neighbour  exclusive increments while other threads store to the
+ *              same cache line and to the rest of the page
+ *
+ * Usage: llsc-stress [test|all] [threads] [iterations]
+ *
+ * Each test prints its throughput and the number of violations it saw;
+ * the exit status is 1 if any test saw one.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define MAX_THREADS 64
+#define ARRAY_SIZE(x) ((int)(sizeof(x) / sizeof((x)[0])))
+
+#define READ_ONCE(x)     (*(volatile __typeof__(x) *)&(x))
+#define WRITE_ONCE(x, v) (*(volatile __typeof__(x) *)&(x) = (v))
+
+static inline void smp_mb(void)
+{
+    asm volatile("dmb ish" : : : "memory");
+}
+
+static int nr_threads = 4;
+static uint32_t iterations = 20000;
+static pthread_barrier_t barrier;
+
+/* What each thread did; the check of a test adds its own violations.  */
+static struct {
+    uint64_t ops;
+    uint64_t violations;
+} __attribute__((aligned(64))) results[MAX_THREADS];
+
+/* Atomically add V to *P; returns the old value.  */
+static inline uint32_t excl_fetch_add(uint32_t *p, uint32_t v)
+{
+    uint32_t old, tmp, fail;
+
+    asm volatile("1: ldrex   %0, [%3]\n"
+                 "   add     %1, %0, %4\n"
+                 "   strex   %2, %1, [%3]\n"
+                 "   teq     %2, #0\n"
+                 "   bne     1b\n"
+                 : "=&r"(old), "=&r"(tmp), "=&r"(fail)
+                 : "r"(p), "r"(v)
+                 : "cc", "memory");
+    return old;
+}
+
+static inline uint32_t excl_xchg(uint32_t *p, uint32_t v)
+{
+    uint32_t old, fail;
+
+    asm volatile("1: ldrex   %0, [%2]\n"
+                 "   strex   %1, %3, [%2]\n"
+                 "   teq     %1, #0\n"
+                 "   bne     1b\n"
+                 : "=&r"(old), "=&r"(fail)
+                 : "r"(p), "r"(v)
+                 : "cc", "memory");
+    return old;
+}
+
+/* Store V to *P if it holds CMP; returns the value seen.  */
+static inline uint32_t excl_cas(uint32_t *p, uint32_t cmp, uint32_t v)
+{
+    uint32_t old, fail;
+
+    asm volatile("1: ldrex   %0, [%2]\n"
+                 "   teq     %0, %3\n"
+                 "   bne     2f\n"
+                 "   strex   %1, %4, [%2]\n"
+                 "   teq     %1, #0\n"
+                 "   bne     1b\n"
+                 "2:\n"
+                 : "=&r"(old), "=&r"(fail)
+                 : "r"(p), "r"(cmp), "r"(v)
+                 : "cc", "memory");
+    return old;
+}
+
+/* Treiber stack.  */
+
+#define TREIBER_NODES (MAX_THREADS * 2)
+
+typedef struct Node {
+    uint32_t next;      /* struct Node * */
+    uint32_t in_use;
+} Node;
+
+static uint32_t treiber_head __attribute__((aligned(64)));
+static Node treiber_pool[TREIBER_NODES];
+
+static void treiber_push(Node *n)
+{
+    uint32_t head;
+
+    do {
+        head = READ_ONCE(treiber_head);
+        WRITE_ONCE(n->next, head);
+        smp_mb();
+    } while (excl_cas(&treiber_head, head, (uint32_t)n) != head);
+}
+
+/*
+ * The loop between the LDREX and the STREX gives the other threads the
+ * time to pop the head and push it back on top of a different next.
+ */
+static Node *treiber_pop(void)
+{
+    uint32_t head, next, fail, spin;
+
+    asm volatile("1: ldrex   %0, [%4]\n"
+                 "   cmp     %0, #0\n"
+                 "   beq     3f\n"
+                 "   ldr     %1, [%0]\n"
+                 "   mov     %3, #64\n"
+                 "2: subs    %3, %3, #1\n"
+                 "   bne     2b\n"
+                 "   strex   %2, %1, [%4]\n"
+                 "   teq     %2, #0\n"
+                 "   bne     1b\n"
+                 "3:\n"
+                 : "=&r"(head), "=&r"(next), "=&r"(fail), "=&r"(spin)
+                 : "r"(&treiber_head)
+                 : "cc", "memory");
+    return (Node *)head;
+}
+
+static void treiber_setup(void)
+{
+    int i;
+
+    treiber_head = 0;
+    for (i = 0; i < nr_threads * 2; i++) {
+        treiber_pool[i].in_use = 0;
+        treiber_push(&treiber_pool[i]);
+    }
+}
+
+static void *treiber_thread(void *arg)
+{
+    int me = (uintptr_t)arg;
+    uint32_t i;
+
+    pthread_barrier_wait(&barrier);
+    for (i = 0; i < iterations; i++) {
+        Node *n = treiber_pop();
+
+        if (!n) {
+            continue;
+        }
+        if (excl_xchg(&n->in_use, 1)) {
+            /* popped twice: leave it to the other owner */
+            results[me].violations++;
+            continue;
+        }
+        smp_mb();
+        WRITE_ONCE(n->in_use, 0);
+        treiber_push(n);
+        results[me].ops++;
+    }
+    return NULL;
+}
+
+/* Every node not found twice must be back on the stack, once.  */
+static uint64_t treiber_check(void)
+{
+    uint64_t lost = 0, found = 0;
+    uint32_t p;
+    int i;
+
+    for (i = 0; i < nr_threads; i++) {
+        lost += results[i].violations;
+    }
+    for (p = treiber_head; p && found <= TREIBER_NODES;
+         p = ((Node *)p)->next) {
+        found++;
+    }
+    if (found + lost != nr_threads * 2) {
+        return 1;
+    }
+    return 0;
+}
+
+/* Locks guarding a plain counter.  */
+
+static uint32_t lock_owner __attribute__((aligned(64)));
+static uint32_t lock_counter;
+
+static void locked_work(int me)
+{
+    if (READ_ONCE(lock_owner)) {
+        results[me].violations++;
+    }
+    WRITE_ONCE(lock_owner, me + 1);
+    lock_counter++;
+    smp_mb();
+    WRITE_ONCE(lock_owner, 0);
+    results[me].ops++;
+}
+
+static uint64_t lock_check(void)
+{
+    uint64_t want = (uint64_t)nr_threads * iterations;
+
+    return lock_counter == want ? 0 : want - lock_counter;
+}
+
+typedef struct MCSNode {
+    uint32_t next;      /* struct MCSNode * */
+    uint32_t locked;
+} __attribute__((aligned(64))) MCSNode;
+
+static uint32_t mcs_tail __attribute__((aligned(64)));
+static MCSNode mcs_nodes[MAX_THREADS];
+
+static void mcs_lock(MCSNode *me)
+{
+    MCSNode *pred;
+
+    WRITE_ONCE(me->next, 0);
+    WRITE_ONCE(me->locked, 1);
+    smp_mb();
+    pred = (MCSNode *)excl_xchg(&mcs_tail, (uint32_t)me);
+    if (pred) {
+        WRITE_ONCE(pred->next, (uint32_t)me);
+        while (READ_ONCE(me->locked)) {
+            /* spin */
+        }
+    }
+    smp_mb();
+}
+
+static void mcs_unlock(MCSNode *me)
+{
+    uint32_t next;
+
+    smp_mb();
+    next = READ_ONCE(me->next);
+    if (!next) {
+        if (excl_cas(&mcs_tail, (uint32_t)me, 0) == (uint32_t)me) {
+            return;
+        }
+        while (!(next = READ_ONCE(me->next))) {
+            /* the successor is linking itself in */
+        }
+    }
+    WRITE_ONCE(((MCSNode *)next)->locked, 0);
+}
+
+static void lock_setup(void)
+{
+    lock_owner = 0;
+    lock_counter = 0;
+    mcs_tail = 0;
+}
+
+static void *mcs_thread(void *arg)
+{
+    int me = (uintptr_t)arg;
+    uint32_t i;
+
+    pthread_barrier_wait(&barrier);
+    for (i = 0; i < iterations; i++) {
+        mcs_lock(&mcs_nodes[me]);
+        locked_work(me);
+        mcs_unlock(&mcs_nodes[me]);
+    }
+    return NULL;
+}
+
+static struct {
+    uint32_t next;
+    uint32_t serving;
+} ticket __attribute__((aligned(64)));
+
+static void ticket_setup(void)
+{
+    lock_setup();
+    ticket.next = 0;
+    ticket.serving = 0;
+}
+
+static void *ticket_thread(void *arg)
+{
+    int me = (uintptr_t)arg;
+    uint32_t i, my;
+
+    pthread_barrier_wait(&barrier);
+    for (i = 0; i < iterations; i++) {
+        my = excl_fetch_add(&ticket.next, 1);
+        while (READ_ONCE(ticket.serving) != my) {
+            /* spin */
+        }
+        smp_mb();
+        locked_work(me);
+        smp_mb();
+        WRITE_ONCE(ticket.serving, my + 1);
+    }
+    return NULL;
+}
+
+/* Seqlock with several writers; the first half of the threads write.  */
+
+static uint32_t seq __attribute__((aligned(64)));
+static uint32_t seq_data[2];
+static uint32_t seq_writers_done;
+
+static void seqlock_setup(void)
+{
+    seq = 0;
+    seq_data[0] = seq_data[1] = 0;
+    seq_writers_done = 0;
+}
+
+static void *seqlock_thread(void *arg)
+{
+    int me = (uintptr_t)arg;
+    int writers = nr_threads / 2;
+    uint32_t i, s, s2, a, b;
+
+    pthread_barrier_wait(&barrier);
+    if (me < writers) {
+        for (i = 0; i < iterations; i++) {
+            do {
+                s = READ_ONCE(seq);
+            } while ((s & 1) || excl_cas(&seq, s, s + 1) != s);
+            smp_mb();
+            WRITE_ONCE(seq_data[0], s);
+            WRITE_ONCE(seq_data[1], s);
+            smp_mb();
+            WRITE_ONCE(seq, s + 2);
+            results[me].ops++;
+        }
+        excl_fetch_add(&seq_writers_done, 1);
+        return NULL;
+    }
+
+    while (READ_ONCE(seq_writers_done) < writers) {
+        s = READ_ONCE(seq);
+        if (s & 1) {
+            continue;
+        }
+        smp_mb();
+        a = READ_ONCE(seq_data[0]);
+        b = READ_ONCE(seq_data[1]);
+        smp_mb();
+        s2 = READ_ONCE(seq);
+        if (s == s2) {
+            if (a != b) {
+                results[me].violations++;
+            }
+            results[me].ops++;
+        }
+    }
+    return NULL;
+}
+
+static uint64_t seqlock_check(void)
+{
+    uint64_t want = 2 * (uint64_t)(nr_threads / 2) * iterations;
+
+    return seq == want ? 0 : 1;
+}
+
+/* SPSC rings: thread 2k produces for thread 2k + 1.  */
+
+#define RING_SIZE 64
+
+typedef struct Ring {
+    uint32_t head __attribute__((aligned(64)));
+    uint32_t tail __attribute__((aligned(64)));
+    uint32_t buf[RING_SIZE] __attribute__((aligned(64)));
+} Ring;
+
+static Ring rings[MAX_THREADS / 2];
+
+static void spsc_setup(void)
+{
+    memset(rings, 0, sizeof(rings));
+}
+
+static void *spsc_thread(void *arg)
+{
+    int me = (uintptr_t)arg;
+    Ring *r = &rings[me / 2];
+    uint32_t i;
+
+    pthread_barrier_wait(&barrier);
+    if (me == nr_threads - 1 && !(me & 1)) {
+        /* odd thread count: nobody to pair with */
+        return NULL;
+    }
+    for (i = 0; i < iterations; i++) {
+        if (!(me & 1)) {
+            while (READ_ONCE(r->head) - READ_ONCE(r->tail) == RING_SIZE) {
+                /* full */
+            }
+            WRITE_ONCE(r->buf[i % RING_SIZE], i);
+            smp_mb();
+            WRITE_ONCE(r->head, i + 1);
+        } else {
+            while (READ_ONCE(r->head) == i) {
+                /* empty */
+            }
+            smp_mb();
+            if (READ_ONCE(r->buf[i % RING_SIZE]) != i) {
+                results[me].violations++;
+            }
+            smp_mb();
+            WRITE_ONCE(r->tail, i + 1);
+        }
+        results[me].ops++;
+    }
+    return NULL;
+}
+
+static uint64_t no_check(void)
+{
+    return 0;
+}
+
+/*
+ * Bounded MPMC queue (after Vyukov): the first half of the threads
+ * produce, the others consume.  Every value must come out exactly once,
+ * which the consumers check with the count, sum and sum of squares.
+ */
+
+#define MPMC_SIZE 256
+
+typedef struct Cell {
+    uint32_t seq;
+    uint32_t val;
+} Cell;
+
+static Cell mpmc_cells[MPMC_SIZE] __attribute__((aligned(64)));
+static uint32_t mpmc_enq __attribute__((aligned(64)));
+static uint32_t mpmc_deq __attribute__((aligned(64)));
+static uint32_t mpmc_taken __attribute__((aligned(64)));
+static struct {
+    uint64_t sum;
+    uint64_t sum2;
+} __attribute__((aligned(64))) mpmc_sums[MAX_THREADS];
+
+static void mpmc_setup(void)
+{
+    int i;
+
+    for (i = 0; i < MPMC_SIZE; i++) {
+        mpmc_cells[i].seq = i;
+    }
+    mpmc_enq = mpmc_deq = mpmc_taken = 0;
+    memset(mpmc_sums, 0, sizeof(mpmc_sums));
+}
+
+static void mpmc_enqueue(uint32_t v)
+{
+    uint32_t pos;
+    Cell *c;
+
+    for (;;) {
+        pos = READ_ONCE(mpmc_enq);
+        c = &mpmc_cells[pos % MPMC_SIZE];
+        smp_mb();
+        if (READ_ONCE(c->seq) == pos &&
+            excl_cas(&mpmc_enq, pos, pos + 1) == pos) {
+            break;
+        }
+    }
+    WRITE_ONCE(c->val, v);
+    smp_mb();
+    WRITE_ONCE(c->seq, pos + 1);
+}
+
+static int mpmc_dequeue(uint32_t *v)
+{
+    uint32_t pos;
+    Cell *c;
+
+    for (;;) {
+        pos = READ_ONCE(mpmc_deq);
+        c = &mpmc_cells[pos % MPMC_SIZE];
+        smp_mb();
+        if (READ_ONCE(c->seq) != pos + 1) {
+            return 0;
+        }
+        if (excl_cas(&mpmc_deq, pos, pos + 1) == pos) {
+            break;
+        }
+    }
+    smp_mb();
+    *v = READ_ONCE(c->val);
+    smp_mb();
+    WRITE_ONCE(c->seq, pos + MPMC_SIZE);
+    return 1;
+}
+
+static void *mpmc_thread(void *arg)
+{
+    int me = (uintptr_t)arg;
+    int producers = nr_threads / 2;
+    uint64_t total = (uint64_t)producers * iterations;
+    uint32_t i, v;
+
+    pthread_barrier_wait(&barrier);
+    if (me < producers) {
+        for (i = 0; i < iterations; i++) {
+            mpmc_enqueue(me * iterations + i + 1);
+            results[me].ops++;
+        }
+        return NULL;
+    }
+    while (READ_ONCE(mpmc_taken) < total) {
+        if (mpmc_dequeue(&v)) {
+            excl_fetch_add(&mpmc_taken, 1);
+            mpmc_sums[me].sum += v;
+            mpmc_sums[me].sum2 += (uint64_t)v * v;
+            results[me].ops++;
+        }
+    }
+    return NULL;
+}
+
+static uint64_t mpmc_check(void)
+{
+    uint64_t n = (uint64_t)(nr_threads / 2) * iterations;
+    uint64_t sum = 0, sum2 = 0, v;
+    int i;
+
+    for (i = 0; i < nr_threads; i++) {
+        sum += mpmc_sums[i].sum;
+        sum2 += mpmc_sums[i].sum2;
+    }
+    for (v = 1; v <= n; v++) {
+        sum -= v;
+        sum2 -= v * v;
+    }
+    return mpmc_taken != n || sum || sum2;
+}
+
+/*
+ * Exclusive increments of a counter that shares its cache line and page
+ * with fields that the other half of the threads keep storing to.  The
+ * stores must never cost an increment, only throughput.
+ */
+static struct {
+    uint32_t counter;
+    uint32_t same_line[15];
+    uint32_t other_lines[1008];
+} neighbour __attribute__((aligned(4096)));
+static uint32_t neighbour_incs_done;
+
+static void neighbour_setup(void)
+{
+    memset(&neighbour, 0, sizeof(neighbour));
+    neighbour_incs_done = 0;
+}
+
+static void *neighbour_thread(void *arg)
+{
+    int me = (uintptr_t)arg;
+    int incrementers = nr_threads - nr_threads / 2;
+    uint32_t i;
+
+    pthread_barrier_wait(&barrier);
+    if (me < incrementers) {
+        for (i = 0; i < iterations; i++) {
+            excl_fetch_add(&neighbour.counter, 1);
+            results[me].ops++;
+        }
+        excl_fetch_add(&neighbour_incs_done, 1);
+        return NULL;
+    }
+    for (i = 0; READ_ONCE(neighbour_incs_done) < incrementers; i++) {
+        if (i & 1) {
+            WRITE_ONCE(neighbour.same_line[me % 15], i);
+        } else {
+            WRITE_ONCE(neighbour.other_lines[(me * 16 + i) % 1008], i);
+        }
+        results[me].ops++;
+    }
+    return NULL;
+}
+
+static uint64_t neighbour_check(void)
+{
+    uint64_t want = (uint64_t)(nr_threads - nr_threads / 2) * iterations;
+
+    return neighbour.counter == want ? 0 : want - neighbour.counter;
+}
+
+typedef struct Test {
+    const char *name;
+    void (*setup)(void);
+    void *(*thread)(void *arg);
+    /* violations found once the threads are done */
+    uint64_t (*check)(void);
+} Test;
+
+static const Test tests[] = {
+    { "treiber",   treiber_setup,   treiber_thread,   treiber_check },
+    { "mcs",       lock_setup,      mcs_thread,       lock_check },
+    { "ticket",    ticket_setup,    ticket_thread,    lock_check },
+    { "seqlock",   seqlock_setup,   seqlock_thread,   seqlock_check },
+    { "spsc",      spsc_setup,      spsc_thread,      no_check },
+    { "mpmc",      mpmc_setup,      mpmc_thread,      mpmc_check },
+    { "neighbour", neighbour_setup, neighbour_thread, neighbour_check },
+};
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static uint64_t run_test(const Test *t)
+{
+    pthread_t threads[MAX_THREADS];
+    uint64_t ops = 0, violations;
+    double start, secs;
+    int i;
+
+    memset(results, 0, sizeof(results));
+    t->setup();
+    pthread_barrier_init(&barrier, NULL, nr_threads + 1);
+    for (i = 0; i < nr_threads; i++) {
+        pthread_create(&threads[i], NULL, t->thread, (void *)(uintptr_t)i);
+    }
+    start = now();
+    pthread_barrier_wait(&barrier);
+    for (i = 0; i < nr_threads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    secs = now() - start;
+    pthread_barrier_destroy(&barrier);
+
+    violations = t->check();
+    for (i = 0; i < nr_threads; i++) {
+        ops += results[i].ops;
+        violations += results[i].violations;
+    }
+    printf("%-9s threads %d: %" PRIu64 " ops in %.3fs, %.2f Mops/s, "
+           "%" PRIu64 " violations\n", t->name, nr_threads, ops, secs,
+           ops / secs / 1e6, violations);
+    return violations;
+}
+
+int main(int argc, char **argv)
+{
+    const char *name = argc > 1 ? argv[1] : "all";
+    uint64_t violations = 0;
+    int i, found = 0;
+
+    if (argc > 2) {
+        nr_threads = atoi(argv[2]);
+        if (nr_threads < 2 || nr_threads > MAX_THREADS) {
+            fprintf(stderr, "threads must be between 2 and %d\n",
+                    MAX_THREADS);
+            return 2;
+        }
+    }
+    if (argc > 3) {
+        iterations = strtoul(argv[3], NULL, 0);
+    }
+
+    for (i = 0; i < ARRAY_SIZE(tests); i++) {
+        if (!strcmp(name, "all") || !strcmp(name, tests[i].name)) {
+            violations += run_test(&tests[i]);
+            found = 1;
+        }
+    }
+    if (!found) {
+        fprintf(stderr, "unknown test '%s' (all", name);
+        for (i = 0; i < ARRAY_SIZE(tests); i++) {
+            fprintf(stderr, ", %s", tests[i].name);
+        }
+        fprintf(stderr, ")\n");
+        return 2;
+    }
+    if (violations) {
+        fprintf(stderr, "FAIL: %" PRIu64 " violations\n", violations);
+        return 1;
+    }
+    return 0;
+}
@@ -273,6 +273,8 @@ const QEMULogItem qemu_log_items[] = {
     { CPU_LOG_TB_NOCHAIN, "nochain",
       "do not chain compiled TBs so that \"exec\" and \"cpu\" show\n"
       "complete traces" },
+    { CPU_LOG_LLSC, "llsc",
+      "user mode only: log exclusive monitor activity" },
     { 0, NULL, NULL },
 };
 